@@ -9,7 +9,11 @@
 #include <arpa/inet.h>
 #include "boost/program_options.hpp"
 #include "audiogram.h"
+#include "batch_sender.h"
+#include "pacer.h"
+#include "fec.h"
 #include "transmitter.h"
+#include "logger.h"
 #include "const.h"
 
 class audio_transmitter : public transmitter {
@@ -25,13 +29,27 @@ protected:
     size_t psize = 512;
     size_t fsize = 128 * 1000 * 1000 * 10;
     std::chrono::milliseconds rtime = std::chrono::milliseconds(250);
+    std::chrono::milliseconds holdoff; // no repeated resends within it
     std::string name = "Nienazwany Nadajnik";
+    size_t batch = 1;
+    bool gso = false;
+    bool huge_pages = false;
+    bool lock_history = false;
+    std::string history_file = ""; // keep the history in memory if empty
+    uint64_t bitrate = 0;
+    uint64_t rexmit_percent = 50;
+    size_t fec_block = 0; // packets per parity packet, 0 if FEC is off
+    bool timestamps = false; // packets carry the time they were sent
+    in_port_t stats_port = 0; // local tcp port serving statistics, 0 for none
     transmitter audio_tr;
+    batch_sender sender;
+    pacer pacing;
     transmitter replies_tr;
 
     virtual int init(int argc, char *argv[]) {
         namespace po = boost::program_options;
         int time = 250;
+        int holdoff_time = -1; // twice rtime unless given
 
         po::options_description desc("Options");
         desc.add_options()
@@ -42,7 +60,18 @@ protected:
                 (",p", po::value<size_t>(&psize), "psize")
                 (",f", po::value<size_t>(&fsize), "fsize")
                 (",r", po::value<int>(&time), "rtime")
-                (",n", po::value<std::string>(&name), "name");
+                (",n", po::value<std::string>(&name), "name")
+                (",B", po::value<size_t>(&batch), "batch")
+                (",G", po::bool_switch(&gso), "gso")
+                (",u", po::bool_switch(&huge_pages), "huge_pages")
+                (",m", po::bool_switch(&lock_history), "lock_history")
+                (",F", po::value<std::string>(&history_file), "history_file")
+                (",R", po::value<uint64_t>(&bitrate), "bitrate")
+                (",X", po::value<uint64_t>(&rexmit_percent), "rexmit_percent")
+                (",k", po::value<size_t>(&fec_block), "fec_block")
+                (",T", po::bool_switch(&timestamps), "timestamps")
+                (",H", po::value<int>(&holdoff_time), "holdoff")
+                (",S", po::value<in_port_t>(&stats_port), "stats_port");
 
         po::variables_map vm;
         try {
@@ -66,8 +95,10 @@ protected:
             std::cerr << "the argument ('0') for option '--C' is invalid\n";
             return 1;
         }
-        if (psize == 0) {
-            std::cerr << "the argument ('0') for option '--p' is invalid\n";
+        if (psize <= audiogram::HEADER_SIZE +
+                     (timestamps ? audiogram::TIMESTAMP_SIZE : 0)) {
+            std::cerr << "the argument ('" << psize
+                      << "') for option '--p' is invalid\n";
             return 1;
         }
         if (fsize == 0) {
@@ -81,6 +112,31 @@ protected:
         } else {
             rtime = std::chrono::milliseconds(time);
         }
+        if (holdoff_time < -1) {
+            std::cerr << "the argument ('" << holdoff_time
+                      << "') for option '--H' is invalid\n";
+            return 1;
+        }
+        holdoff = std::chrono::milliseconds(
+                holdoff_time == -1 ? 2 * time : holdoff_time);
+        if (batch == 0 || batch > fsize / psize) {
+            std::cerr << "the argument ('" << batch
+                      << "') for option '--B' is invalid\n";
+            return 1;
+        }
+        if (gso && batch == 1) { // nothing to glue
+            std::cerr << "option '--G' needs '--B' greater than 1\n";
+            return 1;
+        }
+        if (fec_block == 1 || fec_block > fec::MAX_BLOCK) {
+            std::cerr << "the argument ('" << fec_block
+                      << "') for option '--k' is invalid\n";
+            return 1;
+        }
+        if (!history_file.empty() && (huge_pages || lock_history)) {
+            std::cerr << "options '--u' and '--m' cannot be used with '--F'\n";
+            return 1;
+        }
         if (name.size() > MAX_NAME_LEN) {
             std::cerr << "the argument ('" << name
                       << "') for option '--n' is invalid\n";
@@ -93,29 +149,47 @@ protected:
         return prepare_to_send();
     }
 
-    int send_audiogram(audiogram &a) {
-        if (sendto(audio_tr.sock, (void *)a.get_packet_data(), psize, 0,
-                   (struct sockaddr *)&mcast_addr, sizeof(mcast_addr)) == -1) {
-            std::cerr << "Error: audiogram sendto, errno = " << errno << "\n";
-            return 1;
+    /* bytes of audio data in a packet */
+    size_t audio_size() {
+        return psize - audiogram::HEADER_SIZE -
+               (timestamps ? audiogram::TIMESTAMP_SIZE : 0);
+    }
+
+    /* waits until the pacer lets the next packet of the given kind go */
+    void pace_packet(pacer::kind kind) {
+        if (!pacing.enabled())
+            return;
+
+        uint64_t at = pacing.reserve(audio_size(), kind);
+        if (pacing.must_wait(at)) {
+            flush_packets();
+            pacer::sleep_until(at);
         }
+    }
+
+    /* the packet is only queued, it must stay in place until flushed */
+    int send_packet(const uint8_t *packet) {
+        return sender.queue(packet);
+    }
 
-        return 0;
+    int flush_packets() {
+        return sender.flush();
     }
 
     void send_reply(sockaddr_in &addr) {
         // BOREWICZ_HERE [MCAST_ADDR] [DATA_PORT] [nazwa stacji]
         char msg[MAX_CTRL_MSG_LEN];
-        int msg_size = sprintf(msg, "%s %s %d %s\n", REPLY_MSG,
-                mcast_addr_dotted.data(), data_port, name.data());
-        std::cerr << "Reply " << msg
-                  << " to " << inet_ntoa(addr.sin_addr) << "\n";
+        int msg_size = sprintf(msg, "%s %s %d %s\n%s\n", REPLY_MSG,
+                mcast_addr_dotted.data(), data_port, name.data(),
+                REXMIT_BIN_CAP);
+        LOG_DEBUG("Reply " << msg
+                  << " to " << inet_ntoa(addr.sin_addr));
         if (msg_size < 0)
             return;
 
         if (sendto(replies_tr.sock, (void*)&msg, (size_t)msg_size, 0,
                    (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-            std::cerr << "Error: reply sendto, errno = " << errno << "\n";
+            LOG_ERROR("Error: reply sendto, errno = " << errno);
         }
     }
 
@@ -126,6 +200,8 @@ private:
 
         mcast_addr.sin_family = AF_INET;
         mcast_addr.sin_port = data_port;
+        sender.init(audio_tr.sock, &mcast_addr, psize, batch, gso);
+        pacing.init(bitrate, rexmit_percent, fec_block);
 
         return transmitter::prepare_to_send();
     }
@@ -2,6 +2,8 @@
 #define RADIO_AUDIOGRAM_H
 
 #include <cstdint>
+#include <cstring>
+#include <ctime>
 #include <utility>
 #include <vector>
 #include <arpa/inet.h>
@@ -13,6 +15,11 @@ private:
 
 public:
     static const int HEADER_SIZE = 16;
+    /* Packets with TIMESTAMP_FLAG set in their id carry the time they were
+     * first sent, in ns of CLOCK_REALTIME, in TIMESTAMP_SIZE bytes between
+     * the header and the audio data. The flag is not a part of the id. */
+    static const int TIMESTAMP_SIZE = 8;
+    static const uint64_t TIMESTAMP_FLAG = 1ull << 62u;
 
     audiogram(size_t size, bool fresh) {
         packet = std::vector<uint8_t>(size);
@@ -32,7 +39,7 @@ public:
     }
 
     uint64_t get_packet_id() {
-        return ntohll(*(uint64_t *)(packet.data() + sizeof(uint64_t)));
+        return packet_id_of(packet.data());
     }
 
     void set_packet_id(uint64_t id) {
@@ -67,6 +74,62 @@ public:
         this->fresh = fresh;
     }
 
+    /* accessors for packets stored outside of an audiogram object,
+     * ids are passed in host byte order */
+    static inline uint64_t session_id_of(const uint8_t *packet) {
+        uint64_t id;
+        memcpy(&id, packet, sizeof(id));
+        return ntohll(id);
+    }
+
+    static inline uint64_t packet_id_of(const uint8_t *packet) {
+        uint64_t id;
+        memcpy(&id, packet + sizeof(uint64_t), sizeof(id));
+        return ntohll(id) & ~TIMESTAMP_FLAG;
+    }
+
+    static inline bool has_timestamp(const uint8_t *packet) {
+        uint64_t id;
+        memcpy(&id, packet + sizeof(uint64_t), sizeof(id));
+        return (ntohll(id) & TIMESTAMP_FLAG) != 0;
+    }
+
+    static inline uint64_t timestamp_of(const uint8_t *packet) {
+        uint64_t ns;
+        memcpy(&ns, packet + HEADER_SIZE, sizeof(ns));
+        return ntohll(ns);
+    }
+
+    /* sets the flag, the id has to be written already */
+    static inline void write_timestamp(uint8_t *packet, uint64_t ns) {
+        uint64_t id;
+        memcpy(&id, packet + sizeof(uint64_t), sizeof(id));
+        id = htonll(ntohll(id) | TIMESTAMP_FLAG);
+        ns = htonll(ns);
+        memcpy(packet + sizeof(uint64_t), &id, sizeof(id));
+        memcpy(packet + HEADER_SIZE, &ns, sizeof(ns));
+    }
+
+    /* where the audio data of a packet starts */
+    static inline size_t data_offset(const uint8_t *packet) {
+        return HEADER_SIZE + (has_timestamp(packet) ? TIMESTAMP_SIZE : 0);
+    }
+
+    /* the clock of the timestamps */
+    static inline uint64_t wall_clock_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    }
+
+    static inline void write_header(uint8_t *packet, uint64_t session_id,
+                                    uint64_t packet_id, bool timestamped = false) {
+        session_id = htonll(session_id);
+        packet_id = htonll(timestamped ? packet_id | TIMESTAMP_FLAG : packet_id);
+        memcpy(packet, &session_id, sizeof(session_id));
+        memcpy(packet + sizeof(uint64_t), &packet_id, sizeof(packet_id));
+    }
+
     static inline uint64_t htonll(const uint64_t x) {
         return (1 == htonl(1)) ? x :
                ((uint64_t)htonl((uint32_t)(x & 0xFFFFFFFF)) << 32u) |
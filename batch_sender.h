@@ -0,0 +1,159 @@
+#ifndef RADIO_BATCH_SENDER_H
+#define RADIO_BATCH_SENDER_H
+
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "stats.h"
+#include "logger.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/* Collects equally sized datagrams and sends them with a single sendmmsg
+ * call. With GSO enabled, runs of queued datagrams are glued into UDP_SEGMENT
+ * super-packets which the kernel splits back into separate datagrams.
+ * Queued data is not copied, it has to stay valid until the next flush. */
+class batch_sender {
+private:
+    static const size_t MAX_GSO_SEGMENTS = 64; // UDP_MAX_SEGMENTS in the kernel
+    static const size_t MAX_GSO_BYTES = 65507; // max UDP payload over IPv4
+
+    int sock = -1;
+    struct sockaddr_in *addr = nullptr;
+    size_t seg_size = 0;
+    size_t batch = 1;
+    size_t gso_segs = 1; // datagrams glued into one message, 1 if no GSO
+    std::vector<struct iovec> iovs;
+    std::vector<struct mmsghdr> msgs;
+    size_t queued = 0;
+
+    int set_gso(size_t size) {
+        int val = (int)size;
+        return setsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, sizeof(val));
+    }
+
+    void disable_gso() {
+        set_gso(0);
+        gso_segs = 1;
+        LOG_WARN("GSO disabled, falling back to plain batches");
+    }
+
+    /* builds messages out of queued datagrams starting from the first one */
+    size_t build_msgs(size_t first) {
+        size_t msg_num = 0;
+
+        for (size_t i = first; i < queued; i += gso_segs) {
+            struct msghdr &hdr = msgs[msg_num].msg_hdr;
+            hdr = {};
+            hdr.msg_name = (void *)addr;
+            hdr.msg_namelen = sizeof(*addr);
+            hdr.msg_iov = &iovs[i];
+            hdr.msg_iovlen = std::min(gso_segs, queued - i);
+            ++msg_num;
+        }
+
+        return msg_num;
+    }
+
+public:
+    /* statistics, readable from other threads */
+    counter packets;
+    counter syscalls;
+    counter errors;
+
+    void init(int sock, struct sockaddr_in *addr, size_t seg_size,
+              size_t batch, bool gso) {
+        this->sock = sock;
+        this->addr = addr;
+        this->seg_size = seg_size;
+        this->batch = batch > 0 ? batch : 1;
+
+        gso_segs = 1;
+        if (gso) {
+            size_t segs = std::min((size_t)MAX_GSO_SEGMENTS,
+                                   MAX_GSO_BYTES / seg_size);
+            if (segs < 2) {
+                LOG_WARN("GSO unavailable for packets of " << seg_size
+                         << " bytes");
+            } else if (set_gso(seg_size) < 0) {
+                LOG_WARN("GSO unsupported, errno = " << errno);
+            } else {
+                gso_segs = segs;
+            }
+        }
+
+        iovs = std::vector<struct iovec>(this->batch);
+        msgs = std::vector<struct mmsghdr>(this->batch);
+        queued = 0;
+    }
+
+    size_t get_batch() {
+        return batch;
+    }
+
+    /* returns 1 if a flush triggered by a full batch failed, 0 otherwise */
+    int queue(const uint8_t *data) {
+        iovs[queued].iov_base = (void *)data;
+        iovs[queued].iov_len = seg_size;
+        ++queued;
+
+        if (queued == batch)
+            return flush();
+        return 0;
+    }
+
+    /* returns 1 if some of the queued datagrams could not be sent, 0 otherwise */
+    int flush() {
+        if (queued == 0)
+            return 0;
+
+        size_t msg_num = build_msgs(0), sent = 0;
+        int err = 0;
+
+        while (sent < msg_num) {
+            int ret = sendmmsg(sock, &msgs[sent], (unsigned)(msg_num - sent), 0);
+            syscalls.add();
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (gso_segs > 1 && (errno == EINVAL || errno == EIO)) {
+                    // e.g. segments exceed the device MTU, retry unglued
+                    size_t first = sent * gso_segs;
+                    disable_gso();
+                    msg_num = build_msgs(first);
+                    sent = 0;
+                    continue;
+                }
+                LOG_ERROR("Error: audiogram sendmmsg, errno = " << errno);
+                errors.add();
+                err = 1;
+                break;
+            }
+            sent += (size_t)ret;
+        }
+
+        packets.add(queued);
+        queued = 0;
+        return err;
+    }
+
+    void print_stats() {
+        uint64_t calls = syscalls.get();
+        LOG_INFO("sent " << packets.get() << " packets in " << calls
+                 << " syscalls (" << (calls ? (double)packets.get() / calls : 0)
+                 << " packets per syscall, " << errors.get() << " errors)");
+    }
+};
+
+
+#endif //RADIO_BATCH_SENDER_H
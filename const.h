@@ -10,6 +10,8 @@
 #define NO_CHOICE "    "
 #define LOOKUP_MSG "ZERO_SEVEN_COME_IN\n"
 #define REXMIT_MSG "LOUDER_PLEASE "
+#define REXMIT_BIN_MSG "LOUDER_BIN" // binary variant of REXMIT_MSG
+#define REXMIT_BIN_CAP "REXMIT_BIN" // reply line advertising REXMIT_BIN_MSG
 #define REPLY_MSG "BOREWICZ_HERE"
 static const int TOP_LEN = 3; // number of lines in TOP string
 static const int FOOT_LEN = 1; // number of lines in FOOT string
@@ -17,6 +19,7 @@ static const size_t MAX_UDP_MSG_LEN = 65536;
 static const size_t MAX_CTRL_MSG_LEN = 128;
 static const size_t LOOKUP_MSG_LEN = 19;
 static const size_t MAX_NAME_LEN = 64;
+static const size_t MAX_REXMIT_BIN_LEN = 1400; // fits into a single frame
 
 
 #endif //RADIO_CONST_H
@@ -0,0 +1,53 @@
+#ifndef RADIO_FEC_H
+#define RADIO_FEC_H
+
+#include <cstdint>
+#include <cstring>
+
+/* XOR parity over blocks of k consecutive packets. Block b covers packets
+ * with ids in [b * k * psize, (b + 1) * k * psize). Its parity packet carries
+ * the XOR of their audio data and a packet id made of PARITY_FLAG, k and the
+ * id of the first packet of the block, which lets a receiver rebuild any
+ * single packet lost from the block. */
+class fec {
+public:
+    static const uint64_t PARITY_FLAG = 1ull << 63u;
+    static const unsigned BLOCK_SHIFT = 48;
+    static const uint64_t FIRST_MASK = (1ull << BLOCK_SHIFT) - 1;
+    static const size_t MAX_BLOCK = 255;
+
+    static bool is_parity(uint64_t packet_id) {
+        return (packet_id & PARITY_FLAG) != 0;
+    }
+
+    static uint64_t parity_id(uint64_t first_id, size_t k) {
+        return PARITY_FLAG | ((uint64_t)k << BLOCK_SHIFT) | (first_id & FIRST_MASK);
+    }
+
+    static size_t block_len(uint64_t parity_id) {
+        return (size_t)((parity_id & ~PARITY_FLAG) >> BLOCK_SHIFT);
+    }
+
+    static uint64_t block_first(uint64_t parity_id) {
+        return parity_id & FIRST_MASK;
+    }
+
+    /* dst ^= src, 32 bytes at a time in vector registers */
+    static void xor_into(uint8_t *dst, const uint8_t *src, size_t len) {
+        typedef uint8_t v32 __attribute__((vector_size(32)));
+        size_t i = 0;
+
+        for (; i + sizeof(v32) <= len; i += sizeof(v32)) {
+            v32 a, b;
+            memcpy(&a, dst + i, sizeof(v32));
+            memcpy(&b, src + i, sizeof(v32));
+            a ^= b;
+            memcpy(dst + i, &a, sizeof(v32));
+        }
+        for (; i < len; ++i)
+            dst[i] ^= src[i];
+    }
+};
+
+
+#endif //RADIO_FEC_H
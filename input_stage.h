@@ -0,0 +1,184 @@
+#ifndef RADIO_INPUT_STAGE_H
+#define RADIO_INPUT_STAGE_H
+
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "spsc_ring.h"
+#include "logger.h"
+
+/* Makes the input available without ever blocking its consumer. A regular
+ * file is simply mapped into memory, anything else is drained by a reader
+ * thread doing large reads into a lock-free ring. */
+class input_stage {
+private:
+    static const size_t RING_LEN = 4 * 1024 * 1024;
+    static const size_t READ_LEN = 64 * 1024;
+
+    int fd = -1;
+
+    /* regular file */
+    const uint8_t *map = nullptr;
+    size_t map_len = 0;
+    size_t map_pos = 0;
+
+    /* pipe, socket, terminal */
+    spsc_ring<uint8_t> ring;
+    std::thread reader;
+    std::atomic<bool> done{false}; // the reader will push nothing more
+    std::atomic<bool> reader_waiting{false};
+    int data_fd = -1; // signalled by the reader after each read
+    int space_fd = -1; // signalled by the consumer when the ring drains
+
+    void wait_for_space() {
+        reader_waiting = true;
+        if (ring.size() < ring.capacity()) { // consumer was quicker
+            reader_waiting = false;
+            return;
+        }
+        uint64_t val;
+        if (read(space_fd, &val, sizeof(val)) < 0 && errno != EINTR)
+            LOG_ERROR("Error: input space read, errno = " << errno);
+    }
+
+    void notify(int efd) {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0)
+            LOG_ERROR("Error: input notify, errno = " << errno);
+    }
+
+    void read_input() {
+        std::vector<uint8_t> chunk(READ_LEN);
+
+        while (true) {
+            size_t space = ring.capacity() - ring.size();
+            if (space == 0) {
+                wait_for_space();
+                continue;
+            }
+
+            ssize_t len = read(fd, chunk.data(),
+                               std::min(space, (size_t)READ_LEN));
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len <= 0) {
+                if (len < 0)
+                    LOG_ERROR("Error: input read, errno = " << errno);
+                break;
+            }
+
+            ring.push(chunk.data(), (size_t)len);
+            notify(data_fd);
+        }
+
+        done = true;
+        notify(data_fd);
+    }
+
+public:
+    input_stage() = default;
+    input_stage(const input_stage &) = delete;
+    input_stage &operator=(const input_stage &) = delete;
+
+    ~input_stage() {
+        if (reader.joinable()) {
+            if (done)
+                reader.join();
+            else
+                reader.detach(); // may be stuck in read, the process is ending
+        }
+        if (map != nullptr)
+            munmap((void *)map, map_len);
+        close(data_fd);
+        close(space_fd);
+    }
+
+    /* returns 1 if the input could not be set up, 0 otherwise */
+    int start(int input_fd) {
+        fd = input_fd;
+
+        struct stat st;
+        off_t offset = lseek(fd, 0, SEEK_CUR); // what was read already is skipped
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 &&
+            offset < st.st_size) {
+            void *mem = mmap(nullptr, (size_t)st.st_size, PROT_READ,
+                             MAP_PRIVATE, fd, 0);
+            if (mem != MAP_FAILED) {
+                madvise(mem, (size_t)st.st_size, MADV_SEQUENTIAL);
+                map = (const uint8_t *)mem;
+                map_len = (size_t)st.st_size;
+                map_pos = (size_t)offset;
+                done = true;
+                return 0;
+            }
+            LOG_WARN("input mmap failed, errno = " << errno);
+        }
+
+        data_fd = eventfd(0, EFD_NONBLOCK);
+        space_fd = eventfd(0, 0);
+        if (data_fd < 0 || space_fd < 0) {
+            LOG_ERROR("Error: input eventfd, errno = " << errno);
+            return 1;
+        }
+        ring.init(RING_LEN);
+        reader = std::thread(&input_stage::read_input, this);
+
+        return 0;
+    }
+
+    size_t available() {
+        if (map != nullptr)
+            return map_len - map_pos;
+        return ring.size();
+    }
+
+    /* no more data will become available */
+    bool finished(size_t needed) {
+        return done && available() < needed;
+    }
+
+    /* copies exactly len bytes if that many are available,
+     * returns 1 if they are not, 0 otherwise */
+    int read_exact(uint8_t *dst, size_t len) {
+        if (available() < len)
+            return 1;
+
+        if (map != nullptr) {
+            memcpy(dst, map + map_pos, len);
+            map_pos += len;
+            return 0;
+        }
+
+        ring.pop(dst, len);
+        if (reader_waiting.exchange(false))
+            notify(space_fd);
+        return 0;
+    }
+
+    /* waits at most timeout_ms for new input */
+    void wait(int timeout_ms) {
+        if (data_fd < 0 || done)
+            return;
+
+        struct pollfd polled;
+        polled.fd = data_fd;
+        polled.events = POLLIN;
+        if (poll(&polled, 1, timeout_ms) > 0) {
+            uint64_t val;
+            if (read(data_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                LOG_ERROR("Error: input wait, errno = " << errno);
+        }
+    }
+};
+
+
+#endif //RADIO_INPUT_STAGE_H
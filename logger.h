@@ -0,0 +1,204 @@
+#ifndef RADIO_LOGGER_H
+#define RADIO_LOGGER_H
+
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "spsc_ring.h"
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+/* messages above this level are not compiled in, build with
+ * -DRADIO_LOG_LEVEL=3 to get the debug ones */
+#ifndef RADIO_LOG_LEVEL
+#define RADIO_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/* Asynchronous logger writing to stderr. Every thread queues its messages
+ * in a lock-free ring of its own, a background thread writes them out, so
+ * logging never waits for stderr. When a ring is full the message is
+ * dropped and counted. The queued messages are written out at exit. */
+class logger {
+private:
+    static const size_t RING_LEN = 512; // messages per thread
+    static const size_t MAX_MSG_LEN = 254; // longer ones are cut
+    static const size_t MAX_THREADS = 64; // with a ring of their own
+
+    struct entry {
+        uint16_t len;
+        char text[MAX_MSG_LEN + 2]; // with the newline
+    };
+
+    struct thread_ring {
+        spsc_ring<entry> ring;
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    std::mutex rings_mut; // serialises handing out rings, once per thread
+    thread_ring rings[MAX_THREADS];
+    std::atomic<size_t> ring_num{0};
+    std::thread flusher;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> sleeping{false};
+    int wake_fd = -1;
+
+    logger() {
+        wake_fd = eventfd(0, EFD_NONBLOCK);
+        flusher = std::thread(&logger::flush_loop, this);
+    }
+
+    ~logger() {
+        stopping = true;
+        wake();
+        flusher.join();
+        close(wake_fd);
+    }
+
+    /* nullptr if there are too many threads to give this one a ring */
+    thread_ring *own_ring() {
+        thread_local thread_ring *mine = nullptr;
+        if (mine == nullptr) {
+            std::lock_guard<std::mutex> lock(rings_mut);
+            size_t n = ring_num.load();
+            if (n == MAX_THREADS)
+                return nullptr;
+            rings[n].ring.init(RING_LEN);
+            mine = &rings[n];
+            ring_num = n + 1;
+        }
+        return mine;
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("Error: log wake write");
+    }
+
+    static void write_all(const char *data, size_t len) {
+        while (len > 0) {
+            ssize_t ret = ::write(STDERR_FILENO, data, len);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            data += ret;
+            len -= (size_t)ret;
+        }
+    }
+
+    /* writes out everything queued, returns the number of messages */
+    size_t drain() {
+        std::string out;
+        entry e;
+        size_t num = 0, n = ring_num.load();
+
+        for (size_t i = 0; i < n; ++i) {
+            thread_ring &tr = rings[i];
+            while (tr.ring.pop(e)) {
+                out.append(e.text, e.len);
+                ++num;
+            }
+            uint64_t dropped = tr.dropped.exchange(0);
+            if (dropped > 0)
+                out.append(std::to_string(dropped))
+                   .append(" log messages dropped\n");
+        }
+        write_all(out.data(), out.size());
+        return num;
+    }
+
+    void flush_loop() {
+        struct pollfd polled;
+        polled.fd = wake_fd;
+        polled.events = POLLIN;
+
+        while (true) {
+            drain();
+            if (stopping) {
+                drain();
+                return;
+            }
+
+            sleeping = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (drain() > 0) { // a message came before sleeping was seen
+                sleeping = false;
+                continue;
+            }
+            if (!stopping)
+                poll(&polled, 1, -1);
+            sleeping = false;
+            uint64_t val;
+            if (read(wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                perror("Error: log wake read");
+        }
+    }
+
+public:
+    static logger &get() {
+        static logger instance;
+        return instance;
+    }
+
+    void log(const std::string &msg) {
+        thread_ring *tr = own_ring();
+        entry e;
+        e.len = (uint16_t)std::min(msg.size(), (size_t)MAX_MSG_LEN);
+        memcpy(e.text, msg.data(), e.len);
+        e.text[e.len++] = '\n';
+
+        if (tr == nullptr) {
+            write_all(e.text, e.len);
+            return;
+        }
+        if (!tr->ring.push(e))
+            tr->dropped.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load() && sleeping.exchange(false))
+            wake();
+    }
+};
+
+#define RADIO_LOG(expr) do { \
+        std::ostringstream log_os_; \
+        log_os_ << expr; \
+        logger::get().log(log_os_.str()); \
+    } while (0)
+
+#define LOG_ERROR(expr) RADIO_LOG(expr)
+
+#if RADIO_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(expr) RADIO_LOG(expr)
+#else
+#define LOG_WARN(expr) do {} while (0)
+#endif
+
+#if RADIO_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(expr) RADIO_LOG(expr)
+#else
+#define LOG_INFO(expr) do {} while (0)
+#endif
+
+#if RADIO_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(expr) RADIO_LOG(expr)
+#else
+#define LOG_DEBUG(expr) do {} while (0)
+#endif
+
+
+#endif //RADIO_LOGGER_H
@@ -0,0 +1,72 @@
+#ifndef RADIO_LOSS_MAP_H
+#define RADIO_LOSS_MAP_H
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+
+/* One bit per packet of the receiver's reorder window, set while the packet
+ * is missing and asked for again. Bits are flipped by the thread receiving
+ * packets and read by the thread sending retransmission requests, so a
+ * request stops listing a packet as soon as it arrives. init must not run
+ * concurrently with the readers. */
+class loss_map {
+private:
+    static const size_t WORD_BITS = 64;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    size_t word_num = 0;
+    size_t cap = 0;
+    uint64_t byte_zero = 0;
+    size_t psize = 0;
+
+    /* returns false if the id is not a packet of the window */
+    bool bit_of(uint64_t packet_id, size_t &word, uint64_t &mask) {
+        if (cap == 0 || packet_id < byte_zero ||
+            (packet_id - byte_zero) % psize != 0)
+            return false;
+        uint64_t n = ((packet_id - byte_zero) / psize) % cap;
+        word = (size_t)(n / WORD_BITS);
+        mask = 1ull << (n % WORD_BITS);
+        return true;
+    }
+
+public:
+    void init(uint64_t byte_zero, size_t psize, size_t capacity) {
+        size_t num = (capacity + WORD_BITS - 1) / WORD_BITS;
+        if (num > word_num) {
+            words.reset(new std::atomic<uint64_t>[num]);
+            word_num = num;
+        }
+        for (size_t i = 0; i < word_num; ++i)
+            words[i].store(0, std::memory_order_relaxed);
+        this->byte_zero = byte_zero;
+        this->psize = psize;
+        cap = capacity;
+    }
+
+    void set_missing(uint64_t packet_id) {
+        size_t word;
+        uint64_t mask;
+        if (bit_of(packet_id, word, mask))
+            words[word].fetch_or(mask, std::memory_order_release);
+    }
+
+    void set_arrived(uint64_t packet_id) {
+        size_t word;
+        uint64_t mask;
+        if (bit_of(packet_id, word, mask) &&
+            (words[word].load(std::memory_order_relaxed) & mask))
+            words[word].fetch_and(~mask, std::memory_order_release);
+    }
+
+    bool is_missing(uint64_t packet_id) {
+        size_t word;
+        uint64_t mask;
+        return bit_of(packet_id, word, mask) &&
+               (words[word].load(std::memory_order_acquire) & mask);
+    }
+};
+
+
+#endif //RADIO_LOSS_MAP_H
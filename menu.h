@@ -10,14 +10,19 @@
 #include <cstring>
 #include <cstdlib>
 #include <map>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
 #include "radio_receiver.cpp"
 #include "const.h"
 #include "err.h"
+#include "logger.h"
 
 #define BUFFER_SIZE     65536
 #define TINY_BUF_SIZE   4096
 #define QUEUE_LENGTH    128
-#define MAX_CLIENTS    (_POSIX_OPEN_MAX - 1)
+#define MAX_UI_EVENTS   64
+#define STATS_INTERVAL  1000 // ms between updates of the statistics line
 #define HISTORY_SIZE    3
 #define MAX_PORT_NUM    65535
 #define CONTINUE  0 // must be unequal END and key codes below
@@ -38,6 +43,18 @@ private:
         int count; // number of characters saved in the structure, initially 0
     };
 
+    /* A telnet client. Its screen is kept as lines, only the lines which
+     * differ from what the client shows are sent. While output is waiting
+     * for the socket, later changes are only marked and drawn at once when
+     * it drains. */
+    struct ui_client {
+        read_history history = {};
+        std::string out; // not sent yet
+        std::vector<std::string> shown; // lines on the client's screen
+        bool dirty = false; // screen to be updated once out is sent
+        bool writing = false; // waiting for EPOLLOUT
+    };
+
     const unsigned char ECHO = 1;
     const unsigned char SGA = 3;
     const unsigned char ESC = 27;
@@ -50,54 +67,65 @@ private:
     const unsigned char ENTER_CHARS[2] = {13, 0};
 
     int tcp_sock = -1;
-    read_history HISTORY;
-    int max_count = -1;
-    ssize_t buffer_position = 0; // number of elements read from the buffer
-    ssize_t buffer_volume = 0; // number of elements stored in the buffer
-
-    void reset_server_state() {
-        buffer_position = 0;
-        buffer_volume = 0;
+    int ui_fd = -1; // epoll instance of serve_clients()
+    std::unordered_map<int, ui_client> clients;
+
+    static void append_lines(std::vector<std::string> &lines, const char *text) {
+        std::string all(text);
+        size_t pos = 0, end;
+        while ((end = all.find("\r\n", pos)) != std::string::npos) {
+            lines.push_back(all.substr(pos, end - pos));
+            pos = end + 2;
+        }
     }
 
-    int stations_string(std::string &s) {
-        int i = 0;
-        s.clear();
-
-        for (auto &si : stations) {
-            ++i;
-            if (si.first == station_name)
-                s.append(CHOICE);
-            else
-                s.append(NO_CHOICE);
-            s.append(si.first).append("\r\n");
-        }
+    /* the whole menu, line by line */
+    void menu_lines(std::vector<std::string> &lines) {
+        lines.clear();
+        name_mut.lock();
+        std::string chosen = station_name;
+        name_mut.unlock();
 
-        return i;
+        append_lines(lines, TOP);
+        for (auto &si : *directory.get())
+            lines.push_back((si.first == chosen ? CHOICE : NO_CHOICE) + si.first);
+        append_lines(lines, FOOT);
+
+        std::lock_guard<std::mutex> lock(stats_mut);
+        auto si = stats_by_name.find(chosen);
+        if (si != stats_by_name.end()) {
+            const station_stats &st = *si->second;
+            lines.push_back("  received " + std::to_string(st.received.get()) +
+                            "  lost " + std::to_string(st.lost.get()) +
+                            "  repaired " +
+                            std::to_string(st.repaired_rexmit.get() +
+                                           st.repaired_fec.get()) +
+                            " (~" + std::to_string(st.repair_us.mean() / 1000) +
+                            " ms)  underruns " + std::to_string(st.underruns.get()) +
+                            "  restarts " + std::to_string(st.restarts.get()) +
+                            (st.end_to_end_us.count() == 0 ? "" :
+                             "  latency ~" +
+                             std::to_string(st.end_to_end_us.mean() / 1000) +
+                             " ms"));
+        }
     }
 
-    void print_menu(int action_sock) {
-        char buffer[TINY_BUF_SIZE];
-        std::string options = "";
-        int count = stations_string(options);
-        if (count > max_count)
-            max_count = count;
-        // clears menu space only, prints menu again
-        ssize_t length = snprintf(buffer, TINY_BUF_SIZE,
-                                  "%c[%d;0H%c[1J%c[1;0H%s%s%s",
-                                  ESC,
-                                  TOP_LEN + max_count + FOOT_LEN + 1,
-                                  ESC,
-                                  ESC,
-                                  TOP,
-                                  options.c_str(),
-                                  FOOT);
-        ssize_t sent_length = write(action_sock, buffer, length);
-        if (sent_length != length)
-            syserr("writing to client socket");
+    /* queues the changes between the client's screen and lines */
+    void render(ui_client &c, const std::vector<std::string> &lines) {
+        size_t rows = std::max(lines.size(), c.shown.size());
+        for (size_t i = 0; i < rows; ++i) {
+            if (i < lines.size() && i < c.shown.size() && lines[i] == c.shown[i])
+                continue;
+            c.out.append(1, (char)ESC).append("[").append(std::to_string(i + 1))
+                 .append(";1H").append(1, (char)ESC).append("[2K");
+            if (i < lines.size())
+                c.out.append(lines[i]);
+        }
+        c.shown = lines;
+        c.dirty = false;
     }
 
-    void prepare_client_terminal(int action_sock) {
+    void prepare_client_terminal(ui_client &c) {
         char buffer[TINY_BUF_SIZE];
         /* request suppressing go-ahead, turning off echo,
          * hiding cursor and clear the screen */
@@ -111,146 +139,208 @@ private:
                                   ECHO,
                                   ESC,
                                   ESC);
-        ssize_t sent_length = write(action_sock, buffer, length);
+        c.out.append(buffer, (size_t)length);
+    }
+
+    void watch_client(int fd, ui_client &c, bool writing) {
+        if (c.writing == writing)
+            return;
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+        ev.data.fd = fd;
+        if (epoll_ctl(ui_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+            LOG_ERROR("Error: ui epoll_ctl, errno = " << errno);
+        c.writing = writing;
     }
 
-    void refresh_history(char new_char) {
-        HISTORY.third = HISTORY.second;
-        HISTORY.second = HISTORY.first;
-        HISTORY.first = new_char;
+    /* sends what the socket takes, returns 1 if the client is gone */
+    int flush(int fd, ui_client &c) {
+        while (!c.out.empty()) {
+            ssize_t sent = send(fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                return 1;
+            }
+            c.out.erase(0, (size_t)sent);
+        }
+        watch_client(fd, c, !c.out.empty());
+        return 0;
+    }
 
-        if (HISTORY.count < HISTORY_SIZE)
-            HISTORY.count++;
+    void drop_client(int fd) {
+        epoll_ctl(ui_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        clients.erase(fd);
     }
 
-    int get_key_code(int action_sock, char *buffer) {
-        reset_server_state();
-        if (buffer_position == buffer_volume) { // load to buffer
-            buffer_volume = read(action_sock, buffer, BUFFER_SIZE);
-            buffer_position = 0;
+    /* brings every client's screen up to date */
+    void refresh_clients() {
+        std::vector<std::string> lines;
+        std::vector<int> gone;
+        menu_lines(lines);
 
-            if (buffer_volume < 0)
-                syserr("reading from client socket");
-            else if (buffer_volume == 0)
-                return END;
+        for (auto &ci : clients) {
+            if (!ci.second.out.empty()) {
+                ci.second.dirty = true;
+                continue;
+            }
+            render(ci.second, lines);
+            if (flush(ci.first, ci.second))
+                gone.push_back(ci.first);
         }
+        for (int fd : gone)
+            drop_client(fd);
+    }
+
+    void accept_clients() {
+        std::vector<std::string> lines;
+        menu_lines(lines);
 
-        while (buffer_position < buffer_volume) {
-            refresh_history(buffer[buffer_position]);
-            buffer_position++;
+        while (true) {
+            int msg_sock = accept4(tcp_sock, (struct sockaddr *) nullptr,
+                                   (socklen_t *) nullptr, SOCK_NONBLOCK);
+            if (msg_sock < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    LOG_ERROR("Error: ui accept, errno = " << errno);
+                return;
+            }
 
-            if (HISTORY.count == 3 && HISTORY.third == UP_CHARS[0] &&
-                HISTORY.second == UP_CHARS[1]) {
-                if (HISTORY.first == UP_CHARS[2])
-                    return UP;
-                if (HISTORY.first == DOWN_CHARS[2])
-                    return DOWN;
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = msg_sock;
+            if (epoll_ctl(ui_fd, EPOLL_CTL_ADD, msg_sock, &ev) < 0) {
+                LOG_ERROR("Error: ui epoll_ctl, errno = " << errno);
+                close(msg_sock);
+                continue;
             }
+
+            ui_client &c = clients[msg_sock];
+            prepare_client_terminal(c);
+            render(c, lines);
+            if (flush(msg_sock, c))
+                drop_client(msg_sock);
+        }
+    }
+
+    void refresh_history(read_history &history, char new_char) {
+        history.third = history.second;
+        history.second = history.first;
+        history.first = new_char;
+
+        if (history.count < HISTORY_SIZE)
+            history.count++;
+    }
+
+    /* returns the key completed by new_char */
+    int key_code(read_history &history, char new_char) {
+        refresh_history(history, new_char);
+
+        if (history.count == 3 && history.third == UP_CHARS[0] &&
+            history.second == UP_CHARS[1]) {
+            if (history.first == UP_CHARS[2])
+                return UP;
+            if (history.first == DOWN_CHARS[2])
+                return DOWN;
         }
         return OTHER;
     }
 
-    void up_action(int action_sock) {
-        stations_mut.lock();
+    /* reads the keys pressed, returns 1 if the client is gone */
+    int handle_input(int fd, ui_client &c) {
+        char buffer[TINY_BUF_SIZE];
+
+        while (true) {
+            ssize_t len = read(fd, buffer, sizeof(buffer));
+            if (len == 0)
+                return 1;
+            if (len < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : 1;
+
+            for (ssize_t i = 0; i < len; ++i) {
+                int key = key_code(c.history, buffer[i]);
+                if (key == UP)
+                    up_action();
+                else if (key == DOWN)
+                    down_action();
+            }
+        }
+    }
+
+    void up_action() {
+        auto stations = directory.get();
 
         name_mut.lock();
-        auto station_id = stations.find(station_name);
+        auto station_id = stations->find(station_name);
         name_mut.unlock();
 
-        if (station_id != stations.begin() && station_id != stations.end())
-            set_new_station(std::prev(stations.find(station_name))->second.front());
-        print_menu(action_sock);
-        stations_mut.unlock();
+        if (station_id != stations->begin() && station_id != stations->end())
+            set_new_station(std::prev(station_id)->second.front());
     }
 
-    void down_action(int action_sock) {
-        stations_mut.lock();
+    void down_action() {
+        auto stations = directory.get();
 
         name_mut.lock();
-        auto station_id = stations.find(station_name);
+        auto station_id = stations->find(station_name);
         name_mut.unlock();
 
-        if (station_id != stations.end() &&
-            std::next(station_id) != stations.end())
-            set_new_station(std::next(stations.find(station_name))->second.front());
-        print_menu(action_sock);
-        stations_mut.unlock();
+        if (station_id != stations->end() &&
+            std::next(station_id) != stations->end())
+            set_new_station(std::next(station_id)->second.front());
     }
 
+    /* Serves the telnet clients from one epoll instance. A change of the
+     * list or of the played station comes through list_fd and is drawn on
+     * every screen, the statistics line is updated every STATS_INTERVAL. */
     void serve_clients() {
-        struct pollfd client[MAX_CLIENTS];
-        char buffer[BUFFER_SIZE];
-        ssize_t buf_len[MAX_CLIENTS], buf_pos[MAX_CLIENTS];
-        struct sockaddr_in server;
-        ssize_t rval, length;
-        int msg_sock, i, ret, key;
-
-        for (i = 1; i < MAX_CLIENTS; ++i) {
-            client[i].fd = -1;
-            client[i].events = (POLLIN | POLLOUT);
-        }
-        client[0].fd = tcp_sock;
-        client[0].events = POLLIN;
+        struct epoll_event events[MAX_UI_EVENTS];
 
         while (true) {
-            key = OTHER;
-
-            for (i = 0; i < _POSIX_OPEN_MAX; ++i)
-                client[i].revents = 0;
-
-            ret = poll(client, _POSIX_OPEN_MAX, 5000);
-            if (ret > 0) {
-                if ((client[0].revents & POLLIN)) {
-                    msg_sock = accept(client[0].fd, (struct sockaddr *) nullptr,
-                                      (socklen_t *) nullptr);
-                    if (msg_sock != -1) {
-                        fcntl(msg_sock, F_SETFL, O_NONBLOCK);
-
-                        prepare_client_terminal(msg_sock);
-                        stations_mut.lock();
-                        print_menu(msg_sock);
-                        stations_mut.unlock();
-                        for (i = 1; i < _POSIX_OPEN_MAX; ++i) {
-                            if (client[i].fd == -1) {
-                                client[i].fd = msg_sock;
-                                break;
-                            }
-                        }
-                    }
+            int num = epoll_wait(ui_fd, events, MAX_UI_EVENTS,
+                                 clients.empty() ? -1 : STATS_INTERVAL);
+            if (num < 0) {
+                if (errno != EINTR)
+                    LOG_ERROR("Error: ui epoll_wait, errno = " << errno);
+                continue;
+            }
+            if (num == 0)
+                refresh_clients();
+
+            for (int i = 0; i < num; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == tcp_sock) {
+                    accept_clients();
+                    continue;
                 }
-
-                for (i = 1; i < _POSIX_OPEN_MAX; ++i) {
-                    if (client[i].fd != -1 && (client[i].revents & (POLLIN))) {
-                        std::cerr << "pregetkey\n";
-                        key = get_key_code(client[i].fd, buffer);
-                        std::cerr << "getkey\n";
-
-                        if (key == UP || key == DOWN) {
-                            std::cerr <<"TRUE\n";
-                            break;
-                        }
-                    }
+                if (fd == list_fd) {
+                    uint64_t val;
+                    if (read(list_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                        LOG_ERROR("Error: list read, errno = " << errno);
+                    refresh_clients();
+                    continue;
                 }
-            }
 
-            if (key == UP || key == DOWN || !unchanged_list.test_and_set()) {
-                ret = poll(client, _POSIX_OPEN_MAX, 500);
-                if (ret > 0) {
-                    for (i = 1; i < _POSIX_OPEN_MAX; ++i) {
-                        if (client[i].fd != -1 && (client[i].revents & POLLOUT)) {
-                            if (key == UP) { std::cerr << "upaction\n";
-                                up_action(client[i].fd);
-                            } else if (key == DOWN) {// key == DOWN
-                                down_action(client[i].fd);
-                                std::cerr <<"downadction\n";
-                            } else {
-                                stations_mut.lock();
-                                print_menu(msg_sock);
-                                stations_mut.unlock();
-                            }
-                        }
+                auto ci = clients.find(fd);
+                if (ci == clients.end())
+                    continue;
+                ui_client &c = ci->second;
+                int gone = 0;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    gone = 1;
+                if (!gone && (events[i].events & EPOLLIN))
+                    gone = handle_input(fd, c);
+                if (!gone && (events[i].events & EPOLLOUT)) {
+                    gone = flush(fd, c);
+                    if (!gone && c.out.empty() && c.dirty) {
+                        std::vector<std::string> lines;
+                        menu_lines(lines);
+                        render(c, lines);
+                        gone = flush(fd, c);
                     }
                 }
+                if (gone)
+                    drop_client(fd);
             }
         }
     }
@@ -275,8 +365,24 @@ public:
         // switch to listening (passive open)
         if (listen(tcp_sock, QUEUE_LENGTH) < 0)
             syserr("listening");
+        fcntl(tcp_sock, F_SETFL, O_NONBLOCK);
+
+        if (radio_receiver::init(argc, argv))
+            return 1;
+
+        ui_fd = epoll_create1(0);
+        if (ui_fd < 0)
+            syserr("epoll_create");
+        int fds[] = {tcp_sock, list_fd};
+        for (int fd : fds) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(ui_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                syserr("epoll_ctl");
+        }
 
-        return radio_receiver::init(argc, argv);
+        return 0;
     }
 
     void work() {
@@ -0,0 +1,97 @@
+#ifndef RADIO_PACER_H
+#define RADIO_PACER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+#include <time.h>
+
+/* Spreads packets evenly in time. Fresh packets leave at the configured
+ * bitrate, retransmissions may use extra rexmit_percent of it on top, so
+ * repairs do not slow the stream down while the total stays bounded.
+ * Parity packets, one after every parity_block fresh ones, have a budget of
+ * their own, bitrate / parity_block, and take nothing from the other two. */
+class pacer {
+public:
+    enum kind {
+        FRESH, // sent for the first time
+        REXMIT,
+        PARITY
+    };
+
+private:
+    static const uint64_t NS_IN_S = 1000 * 1000 * 1000;
+    static const uint64_t MIN_SLEEP_NS = 50 * 1000; // less is left to batching
+    static const uint64_t MAX_CREDIT_NS = 1000 * 1000; // burst after idling
+
+    uint64_t bitrate = 0; // 0 if pacing is off
+    uint64_t rexmit_percent = 0;
+    uint64_t fresh_next = 0; // when the next fresh packet may leave
+    uint64_t wire_next = 0; // when any next fresh or resent packet may leave
+    uint64_t parity_rate = 0;
+    uint64_t parity_next = 0; // when the next parity packet may leave
+
+    uint64_t cost(size_t bytes, uint64_t rate) {
+        return (uint64_t)((double)bytes * 8 * NS_IN_S / rate);
+    }
+
+public:
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * NS_IN_S + (uint64_t)ts.tv_nsec;
+    }
+
+    static void sleep_until(uint64_t at) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(at / NS_IN_S);
+        ts.tv_nsec = (long)(at % NS_IN_S);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                               nullptr) == EINTR) {
+        }
+    }
+
+    void init(uint64_t bitrate, uint64_t rexmit_percent,
+              size_t parity_block = 0) {
+        this->bitrate = bitrate;
+        this->rexmit_percent = rexmit_percent;
+        parity_rate = parity_block ? bitrate / parity_block : 0;
+        fresh_next = 0;
+        wire_next = 0;
+        parity_next = 0;
+    }
+
+    bool enabled() {
+        return bitrate != 0;
+    }
+
+    /* returns the moment (CLOCK_MONOTONIC, in ns) at which a packet carrying
+     * the given number of bytes may be sent */
+    uint64_t reserve(size_t bytes, kind k) {
+        uint64_t t = now();
+        uint64_t floor = t > MAX_CREDIT_NS ? t - MAX_CREDIT_NS : 0;
+
+        if (k == PARITY && parity_rate != 0) {
+            uint64_t at = std::max(parity_next, floor);
+            parity_next = at + cost(bytes, parity_rate);
+            return at;
+        }
+
+        uint64_t at = std::max(wire_next, floor);
+        if (k == FRESH) {
+            at = std::max(at, std::max(fresh_next, floor));
+            fresh_next = at + cost(bytes, bitrate);
+        }
+        wire_next = at + cost(bytes, bitrate * (100 + rexmit_percent) / 100);
+
+        return at;
+    }
+
+    bool must_wait(uint64_t at) {
+        return at > now() + MIN_SLEEP_NS;
+    }
+};
+
+
+#endif //RADIO_PACER_H
@@ -0,0 +1,288 @@
+#ifndef RADIO_PACKET_RING_H
+#define RADIO_PACKET_RING_H
+
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "audiogram.h"
+#include "logger.h"
+
+/* Fixed-capacity FIFO of equally sized packets kept in one contiguous slab.
+ * Packets are written in place, pushing into a full ring overwrites the
+ * oldest packet. The slab is either anonymous memory or a shared mapping of
+ * a ring file which outlives the process. In a ring file every packet is
+ * followed by a checksum written by commit once the packet is complete, so
+ * a packet cut off by a crash is not taken over. */
+class packet_ring {
+private:
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+    static const size_t FILE_HEADER_LEN = 4096; // the slab starts page aligned
+    static const size_t TRIM_LEN = 8 * 1024 * 1024;
+    static const uint64_t FILE_MAGIC = 0x474e495254444152; // "RADTRING"
+    static const size_t COMMIT_LEN = sizeof(uint64_t); // after file packets
+
+    /* first page of a ring file */
+    struct file_header {
+        uint64_t magic;
+        uint64_t stride;
+        uint64_t cap;
+        uint64_t head;
+        uint64_t count;
+    };
+
+    uint8_t *map = nullptr;
+    size_t map_len = 0;
+    uint8_t *slab = nullptr;
+    file_header *header = nullptr; // nullptr for anonymous memory
+    size_t trim_from = 0; // slab offset not yet dropped from the mapping
+    size_t stride = 0;
+    size_t psize = 0;
+    size_t cap = 0;
+    size_t head = 0; // slot of the oldest packet
+    size_t count = 0;
+
+    void release() {
+        if (map != nullptr)
+            munmap(map, map_len);
+        map = nullptr;
+        slab = nullptr;
+        header = nullptr;
+        map_len = 0;
+    }
+
+    /* written packets are already in the page cache, there is no reason to
+     * keep them resident in this process */
+    void trim(size_t written_to) {
+        if (written_to < trim_from)
+            trim_from = 0; // wrapped around
+        if (written_to - trim_from < TRIM_LEN)
+            return;
+
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t from = trim_from / page * page;
+        size_t to = written_to / page * page;
+        if (to > from)
+            madvise(slab + from, to - from, MADV_DONTNEED);
+        trim_from = to;
+    }
+
+    static uint64_t checksum(const uint8_t *data, size_t len) {
+        uint64_t sum = 0xcbf29ce484222325, word;
+        size_t i = 0;
+        for (; i + sizeof(word) <= len; i += sizeof(word)) {
+            memcpy(&word, data + i, sizeof(word));
+            sum = (sum ^ word) * 0x100000001b3;
+        }
+        for (; i < len; ++i)
+            sum = (sum ^ data[i]) * 0x100000001b3;
+        return sum;
+    }
+
+    bool committed(size_t i) {
+        uint64_t sum;
+        memcpy(&sum, (*this)[i] + psize, sizeof(sum));
+        return sum == checksum((*this)[i], psize);
+    }
+
+    /* drops trailing packets whose write was interrupted and keeps
+     * the ids contiguous */
+    void check_resumed() {
+        while (count > 0 && !committed(count - 1))
+            --count;
+        while (count > 1) {
+            uint64_t oldest = packet_id_at(0), newest = packet_id_at(count - 1);
+            if (newest > oldest && newest - oldest == (count - 1) * psize)
+                return;
+            --count;
+        }
+    }
+
+    uint64_t packet_id_at(size_t i) {
+        return audiogram::packet_id_of((*this)[i]);
+    }
+
+    /* returns 1 if the slab could not be mapped, 0 otherwise */
+    int map_slab(size_t len, bool huge) {
+        void *mem = MAP_FAILED;
+
+        if (huge) {
+            map_len = (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            mem = mmap(nullptr, map_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem == MAP_FAILED)
+                LOG_WARN("no huge pages reserved for the history, "
+                         << "errno = " << errno);
+        }
+        if (mem == MAP_FAILED) {
+            map_len = len;
+            mem = mmap(nullptr, map_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                LOG_ERROR("Error: history mmap, errno = " << errno);
+                map_len = 0;
+                return 1;
+            }
+            if (huge)
+                madvise(mem, map_len, MADV_HUGEPAGE);
+        }
+
+        map = (uint8_t *)mem;
+        slab = map;
+        return 0;
+    }
+
+public:
+    packet_ring() = default;
+    packet_ring(const packet_ring &) = delete;
+    packet_ring &operator=(const packet_ring &) = delete;
+
+    ~packet_ring() {
+        release();
+    }
+
+    /* returns 1 if the ring could not be allocated, 0 otherwise */
+    int init(size_t psize, size_t capacity, bool huge, bool lock) {
+        release();
+        stride = psize;
+        this->psize = psize;
+        cap = capacity;
+        head = 0;
+        count = 0;
+
+        if (map_slab(stride * cap, huge))
+            return 1;
+        if (lock && mlock(slab, map_len) < 0)
+            LOG_WARN("history could not be locked in memory, errno = "
+                     << errno);
+
+        return 0;
+    }
+
+    /* Maps a preallocated ring file, packets kept there by a previous run
+     * with the same psize and capacity are taken over.
+     * returns 1 if the file could not be used, 0 otherwise */
+    int init_file(const std::string &path, size_t psize, size_t capacity) {
+        release();
+        stride = psize + COMMIT_LEN;
+        this->psize = psize;
+        cap = capacity;
+        head = 0;
+        count = 0;
+        trim_from = 0;
+
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            LOG_ERROR("Error: history file open, errno = " << errno);
+            return 1;
+        }
+
+        map_len = FILE_HEADER_LEN + stride * cap;
+        int err = posix_fallocate(fd, 0, (off_t)map_len);
+        if (err) {
+            LOG_ERROR("Error: history file allocation, errno = " << err);
+            close(fd);
+            return 1;
+        }
+
+        void *mem = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            LOG_ERROR("Error: history file mmap, errno = " << errno);
+            map_len = 0;
+            return 1;
+        }
+        map = (uint8_t *)mem;
+        header = (file_header *)map;
+        slab = map + FILE_HEADER_LEN;
+        madvise(slab, stride * cap, MADV_SEQUENTIAL);
+
+        if (header->magic == FILE_MAGIC && header->stride == stride &&
+            header->cap == cap && header->head < cap && header->count <= cap) {
+            head = header->head;
+            count = header->count;
+            check_resumed();
+        } else {
+            header->magic = FILE_MAGIC;
+            header->stride = stride;
+            header->cap = cap;
+        }
+        header->head = head;
+        header->count = count;
+
+        return 0;
+    }
+
+    /* returns the slot for a new newest packet */
+    uint8_t *push() {
+        uint8_t *slot;
+
+        if (count == cap) {
+            slot = slab + head * stride;
+            head = (head + 1) % cap;
+        } else {
+            slot = slab + ((head + count) % cap) * stride;
+            ++count;
+        }
+
+        if (header != nullptr) {
+            header->head = head;
+            header->count = count;
+            trim((size_t)(slot - slab));
+        }
+
+        return slot;
+    }
+
+    /* marks the newest packet complete, to be called once it is written */
+    void commit(uint8_t *packet) {
+        if (header == nullptr)
+            return;
+        uint64_t sum = checksum(packet, psize);
+        memcpy(packet + psize, &sum, sizeof(sum));
+    }
+
+    /* i-th packet counting from the oldest one */
+    uint8_t *operator[](size_t i) {
+        return slab + ((head + i) % cap) * stride;
+    }
+
+    /* position of a packet in the slab, stable while the packet is kept */
+    size_t slot_of(const uint8_t *packet) {
+        return (size_t)(packet - slab) / stride;
+    }
+
+    uint8_t *back() {
+        return (*this)[count - 1];
+    }
+
+    size_t size() {
+        return count;
+    }
+
+    size_t capacity() {
+        return cap;
+    }
+
+    bool empty() {
+        return count == 0;
+    }
+
+    /* forgets every packet, a ring file starts over too */
+    void clear() {
+        head = 0;
+        count = 0;
+        if (header != nullptr) {
+            header->head = head;
+            header->count = count;
+        }
+    }
+};
+
+
+#endif //RADIO_PACKET_RING_H
@@ -0,0 +1,71 @@
+#ifndef RADIO_PLAYOUT_DELAY_H
+#define RADIO_PLAYOUT_DELAY_H
+
+#include <cstdint>
+#include <algorithm>
+#include <time.h>
+
+/* Chooses how long the receiver buffers a stream before it starts playing.
+ * Tracks the mean and the jitter of packet inter-arrival times (RFC 3550
+ * style, gain 1/16) and how late repaired packets arrive, and asks for
+ * enough delay to absorb both, kept within [min, max]. */
+class playout_delay {
+private:
+    static const uint64_t NS_IN_MS = 1000 * 1000;
+    static const int JITTER_MARGIN = 4; // in jitter estimates
+
+    uint64_t min_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t last_arrival = 0; // 0 before the first packet of a session
+    int64_t mean_gap = 0; // between consecutive packets, in ns
+    int64_t jitter = 0;
+    int64_t repair = 0; // how long after its successors a lost packet comes
+
+public:
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 * NS_IN_MS + (uint64_t)ts.tv_nsec;
+    }
+
+    void init(unsigned long min_ms, unsigned long max_ms) {
+        min_ns = min_ms * NS_IN_MS;
+        max_ns = max_ms * NS_IN_MS;
+    }
+
+    /* a new session starts, estimates from earlier ones are kept */
+    void restart() {
+        last_arrival = 0;
+    }
+
+    /* the stream moved forward by the given number of packets at time at */
+    void on_arrival(uint64_t at, uint64_t packets) {
+        if (last_arrival != 0 && at >= last_arrival && packets > 0) {
+            int64_t gap = (int64_t)((at - last_arrival) / packets);
+            if (mean_gap == 0)
+                mean_gap = gap;
+            int64_t dev = gap > mean_gap ? gap - mean_gap : mean_gap - gap;
+            mean_gap += (gap - mean_gap) / 16;
+            jitter += (dev - jitter) / 16;
+        }
+        last_arrival = at;
+    }
+
+    /* a packet arrived behind the given number of later packets */
+    void on_repair(uint64_t late_packets) {
+        int64_t sample = mean_gap * (int64_t)late_packets;
+        if (sample > repair)
+            repair = sample; // be ready for the worst repair at once
+        else
+            repair += (sample - repair) / 64;
+    }
+
+    /* current delay target in ns */
+    uint64_t target() {
+        uint64_t want = (uint64_t)(JITTER_MARGIN * jitter + repair);
+        return std::min(std::max(want, min_ns), max_ns);
+    }
+};
+
+
+#endif //RADIO_PLAYOUT_DELAY_H
@@ -7,6 +7,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sched.h>
 #include <ctime>
 #include <chrono>
 #include <thread>
@@ -15,34 +21,73 @@
 #include <sys/time.h>
 #include <atomic>
 #include <unordered_map>
+#include <map>
+#include <memory>
+#include <algorithm>
 #include "boost/program_options.hpp"
 #include "audiogram.h"
+#include "rexmit_msg.h"
+#include "fec.h"
+#include "reorder_buf.h"
+#include "playout_delay.h"
+#include "standby.h"
+#include "station_dir.h"
+#include "loss_map.h"
+#include "spsc_ring.h"
+#include "timer_wheel.h"
+#include "stats.h"
+#include "logger.h"
 #include "receiver.h"
 #include "transmitter.h"
 #include "const.h"
 
 class radio_receiver {
 protected:
-    struct station_det {
-        struct sockaddr_in addr;
-        struct sockaddr_in direct;
-        std::string name;
-        time_t last_answ;
-    };
-
     struct rexmit_data {
         uint64_t min;
         uint64_t max;
         size_t psize;
         struct sockaddr_in direct;
+        bool bin_rexmit;
+        unsigned tries; // requests sent so far
+        uint64_t generation; // of losses when the gap was found
+    };
+
+    /* statistics of a station, updated by play() only */
+    struct station_stats {
+        counter received; // valid packets read from the socket
+        counter duplicates; // packets buffered or played already
+        counter gaps; // holes found in the stream
+        counter lost; // packets in them
+        counter repaired_rexmit; // missing packets which were sent again
+        counter repaired_fec; // missing packets rebuilt from parity
+        counter underruns; // times the output waited for a missing packet
+        counter restarts; // sessions ended other than by a switch
+        histogram repair_us; // from finding a packet missing to having it
+        histogram occupancy; // packets buffered ahead of the output
+        /* stages of the way of timestamped packets */
+        histogram network_us; // from sending to the kernel receiving it
+        histogram reorder_us; // from receiving to handing it out
+        histogram output_us; // from handing it out to writing it
+        histogram end_to_end_us; // from sending to writing it
     };
 
     static const uint32_t DEFAULT_DISCOVER_ADDR = (uint32_t)-1;
     static const time_t DISCONNECT_INTERVAL = 20; // in seconds
     static const int LOOKUP_INTERVAL = 5; // in seconds
+    static const int MAX_PLAY_EVENTS = 4;
+    static const int MAX_CONTROL_EVENTS = 8;
+    static const int MAX_REPLIES_PER_WAKEUP = 64;
+    static const int MAX_READS_PER_WAKEUP = 64;
+    static const unsigned RECV_BATCH = 16; // packets per recvmmsg
+    static const int MAX_WRITE_PACKETS = 64; // packets per writev and hand-out
+    static const int STANDBY_NUM = 2; // stations next to the played one
+    static const size_t NACK_Q_LEN = 4096;
+    static const unsigned MAX_BACKOFF_SHIFT = 3; // retry at least every 8 rtime
 
     /* current station data */
     struct sockaddr_in direct_addr;
+    bool direct_bin_rexmit = false;
     std::string station_name;
     struct sockaddr_in mcast_addr = {0};
 
@@ -52,10 +97,55 @@ protected:
     size_t bsize = 65536;
     size_t psize;
     unsigned long rtime = 250;
+    unsigned long min_delay = 20; // in milliseconds
+    unsigned long max_delay = 1000;
+    bool warm_standby = false;
+    in_port_t stats_port = 0; // local tcp port serving statistics, 0 for none
+    int net_cpu = -1; // core play() is pinned to, -1 for none
+    int out_cpu = -1; // core output() is pinned to
 
-    std::map<std::string, std::list<struct station_det>> stations;
-    std::vector<audiogram> audio_buf;
-    unsigned long out_id = 0;
+    station_dir directory;
+    reorder_buf audio_buf;
+    playout_delay delay;
+    uint64_t arrival_ns = 0; // when the packets being handled were received
+    standby_station standby[STANDBY_NUM]; // guarded by current_mut
+    int promoted = -1; // standby the next session starts from
+    std::mutex standby_mut;
+    std::vector<sockaddr_in> standby_want; // guarded by standby_mut
+    int standby_fd = -1; // eventfd telling play() that standby_want changed
+    unsigned long out_id = 0; // next packet to hand out
+    spsc_ring<uint32_t> out_q; // slots of ready packets, play() to output()
+    int out_fd = -1; // eventfd signalled with every run pushed to out_q
+    int done_fd = -1; // eventfd signalled by output() after every write
+    uint64_t handed_total = 0; // packets pushed to out_q, written by play()
+    std::atomic<uint64_t> written_total{0}; // taken off out_q by output()
+    std::atomic<uint64_t> discard_to{0}; // packets before it are not written
+    size_t fec_k = 0; // FEC block length of the stream, 0 if no parity seen
+    std::vector<audiogram> parity_buf;
+    std::vector<uint64_t> gap_found; // per position, when it went missing
+    bool stamped = false; // the session carries timestamps, set by play()
+    uint64_t kernel_rx_ns = 0; // when the kernel got the packet handled, or 0
+    std::vector<uint64_t> rx_ns; // per position, kernel_rx_ns of its packet
+    std::vector<uint64_t> handed_ns; // per slab slot, when it was handed out
+    std::mutex stats_mut; // guards stats_by_name, not the statistics
+    std::map<std::string, std::unique_ptr<station_stats>> stats_by_name;
+    station_stats unnamed_stats; // while no station is chosen
+    station_stats *stats = &unnamed_stats; // of the played one, for play()
+    counter rexmit_msgs; // requests sent, by control()
+    counter rexmit_ids; // packet ids asked for in them
+    std::list<std::pair<uint64_t, uint64_t>> fec_pending; // gaps to repair
+    loss_map losses; // packets asked for again, init under loss_mut
+    std::mutex loss_mut;
+    uint64_t loss_generation = 0; // guarded by loss_mut, written by play()
+    spsc_ring<rexmit_data> nack_q; // new gaps, from play() to control()
+    int nack_fd = -1; // eventfd signalled with every gap pushed to nack_q
+    timer_wheel<rexmit_data> nack_wheel; // requests to send, used by control()
+    bool started_playing = false; // used by control()
+    int control_fd = -1; // epoll instance of control()
+    int lookup_fd = -1; // timerfd, every LOOKUP_INTERVAL
+    int expiry_fd = -1; // timerfd, when the next station may time out
+    int rexmit_fd = -1; // timerfd, when the next request is due
+    int stats_sock = -1; // listening on stats_port
     receiver lookup_tr_reply_rcv; // bound, receives from the same address it sends
     transmitter rexmit_tr;
     transmitter direct_tr;
@@ -63,15 +153,10 @@ protected:
     std::mutex current_mut;
     std::mutex direct_mut;
     std::mutex new_station_mut;
-    std::mutex stations_mut;
     std::mutex name_mut;
     std::atomic<uint64_t> last_id_written;
-    std::atomic_flag keep_waiting = ATOMIC_FLAG_INIT;
-    std::atomic_flag keep_playing = ATOMIC_FLAG_INIT;
-    std::atomic_flag unchanged_list = ATOMIC_FLAG_INIT;
-    std::vector<std::mutex> rexmit_batch_mut;
-    std::vector<std::unordered_map<std::string, std::list<rexmit_data>>>
-            rexmit_batch;
+    int switch_fd = -1; // eventfd telling play() that the station changed
+    int list_fd = -1; // eventfd telling the menu that the list or choice changed
 
 public:
     int init(int argc, char *argv[]) {
@@ -87,7 +172,13 @@ public:
                 (",U", po::value<in_port_t>(&ui_port), "ui_port")
                 (",b", po::value<size_t>(&bsize), "bsize")
                 (",n", po::value<std::string>(&station_name), "name")
-                (",r", po::value<unsigned long>(&rtime), "rtime");
+                (",r", po::value<unsigned long>(&rtime), "rtime")
+                (",l", po::value<unsigned long>(&min_delay), "min_delay")
+                (",L", po::value<unsigned long>(&max_delay), "max_delay")
+                (",w", po::bool_switch(&warm_standby), "warm_standby")
+                (",c", po::value<int>(&net_cpu), "net_cpu")
+                (",o", po::value<int>(&out_cpu), "out_cpu")
+                (",S", po::value<in_port_t>(&stats_port), "stats_port");
 
         po::variables_map vm;
         try {
@@ -119,20 +210,34 @@ public:
             std::cerr << "the argument ('0') for option '--b' is invalid\n";
             return 1;
         }
+        if (max_delay < min_delay) {
+            std::cerr << "the argument ('" << max_delay
+                      << "') for option '--L' is invalid\n";
+            return 1;
+        }
+        delay.init(min_delay, max_delay);
 
         last_id_written = 0;
-        rexmit_batch_mut = std::vector<std::mutex>(rtime);
-        rexmit_batch = std::vector<std::unordered_map<std::string,
-                std::list<rexmit_data>>>(rtime);
+        nack_q.init(NACK_Q_LEN);
+        // room for a whole buffer of the smallest packets
+        out_q.init(std::max(bsize / audiogram::HEADER_SIZE, (size_t)2));
         lookup_tr_reply_rcv.prepare_to_receive();
         fcntl(lookup_tr_reply_rcv.sock, F_SETFL, O_NONBLOCK);
         rexmit_tr.prepare_to_send();
         direct_tr.prepare_to_send_nonblock();
-        keep_waiting.test_and_set();
-        keep_playing.test_and_set();
-        unchanged_list.test_and_set();
+        switch_fd = eventfd(0, EFD_NONBLOCK);
+        standby_fd = eventfd(0, EFD_NONBLOCK);
+        nack_fd = eventfd(0, EFD_NONBLOCK);
+        list_fd = eventfd(0, EFD_NONBLOCK);
+        out_fd = eventfd(0, 0);
+        done_fd = eventfd(0, 0);
+        if (switch_fd < 0 || standby_fd < 0 || nack_fd < 0 || list_fd < 0 ||
+            out_fd < 0 || done_fd < 0) {
+            LOG_ERROR("Error: eventfd, errno = " << errno);
+            return 1;
+        }
 
-        return 0;
+        return prepare_control();
     }
 
     void work() {
@@ -142,208 +247,377 @@ public:
 
         // run other threads
         std::thread t1(&radio_receiver::play, this);
-        std::thread t2(&radio_receiver::receive_replies, this);
-        std::thread t3(&radio_receiver::send_rexmits, this);
+        std::thread t2(&radio_receiver::output, this);
+
+        control();
+    }
+
+protected:
+    /* Creates the epoll instance and the timers of control(). The first
+     * lookup is sent at once. */
+    int prepare_control() {
+        control_fd = epoll_create1(0);
+        lookup_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        expiry_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+        rexmit_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (control_fd < 0 || lookup_fd < 0 || expiry_fd < 0 || rexmit_fd < 0) {
+            LOG_ERROR("Error: control fds, errno = " << errno);
+            return 1;
+        }
+
+        struct itimerspec lookups = {};
+        lookups.it_value.tv_nsec = 1;
+        lookups.it_interval.tv_sec = LOOKUP_INTERVAL;
+        if (timerfd_settime(lookup_fd, 0, &lookups, nullptr) < 0) {
+            LOG_ERROR("Error: lookup timer, errno = " << errno);
+            return 1;
+        }
+
+        if (stats_port != 0 && (stats_sock = stats_listen(stats_port)) < 0)
+            return 1;
+
+        int fds[] = {lookup_tr_reply_rcv.sock, lookup_fd, expiry_fd, nack_fd,
+                     rexmit_fd, stats_sock};
+        for (int fd : fds) {
+            if (fd < 0)
+                continue;
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(control_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                LOG_ERROR("Error: control epoll_ctl, errno = " << errno);
+                return 1;
+            }
+        }
+        nack_wheel.init(now_ms());
+
+        return 0;
+    }
+
+    /* Control plane of the receiver: lookups, replies, expiry of stations
+     * and retransmission requests, all driven by one epoll instance, so the
+     * thread sleeps until a reply comes or a timer goes off. */
+    void control() {
+        struct epoll_event events[MAX_CONTROL_EVENTS];
 
         while (true) {
-            delete_inactive_stations();std::cerr <<" bef sendlookup\n";
-            send_lookup();std::cerr << "aft sendlookup\n";
-            sleep(LOOKUP_INTERVAL);
+            int num = epoll_wait(control_fd, events, MAX_CONTROL_EVENTS, -1);
+            if (num < 0) {
+                if (errno != EINTR)
+                    LOG_ERROR("Error: control epoll_wait, errno = "
+                              << errno);
+                continue;
+            }
+
+            for (int i = 0; i < num; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == lookup_tr_reply_rcv.sock) {
+                    receive_replies();
+                } else if (fd == lookup_fd) {
+                    drain_fd(lookup_fd);
+                    send_lookup();
+                } else if (fd == expiry_fd) {
+                    drain_fd(expiry_fd);
+                    delete_inactive_stations();
+                    arm_expiry();
+                } else if (fd == nack_fd || fd == rexmit_fd) {
+                    drain_fd(fd);
+                    send_rexmits();
+                } else if (fd == stats_sock) {
+                    stats_serve(stats_sock,
+                                [this](std::string &out) { stats_json(out); });
+                }
+            }
         }
     }
 
-protected:
+    station_stats &stats_of(const std::string &name) {
+        if (name.empty())
+            return unnamed_stats;
+        std::lock_guard<std::mutex> lock(stats_mut);
+        std::unique_ptr<station_stats> &st = stats_by_name[name];
+        if (!st)
+            st.reset(new station_stats());
+        return *st;
+    }
+
+    void stats_json(std::string &out) {
+        name_mut.lock();
+        std::string playing = station_name;
+        name_mut.unlock();
+
+        out.append("{");
+        json_field(out, "rexmit_msgs", rexmit_msgs.get(), true);
+        json_field(out, "rexmit_ids", rexmit_ids.get());
+        out.append(",\"stations\":[");
+        std::lock_guard<std::mutex> lock(stats_mut);
+        for (auto si = stats_by_name.begin(); si != stats_by_name.end(); ++si) {
+            const station_stats &st = *si->second;
+            if (si != stats_by_name.begin())
+                out.append(",");
+            out.append("{\"name\":");
+            json_string(out, si->first);
+            out.append(",\"playing\":")
+               .append(si->first == playing ? "true" : "false");
+            json_field(out, "received", st.received.get());
+            json_field(out, "duplicates", st.duplicates.get());
+            json_field(out, "gaps", st.gaps.get());
+            json_field(out, "lost", st.lost.get());
+            json_field(out, "repaired_rexmit", st.repaired_rexmit.get());
+            json_field(out, "repaired_fec", st.repaired_fec.get());
+            json_field(out, "underruns", st.underruns.get());
+            json_field(out, "restarts", st.restarts.get());
+            json_field(out, "repair_us", st.repair_us);
+            json_field(out, "occupancy", st.occupancy);
+            json_field(out, "network_us", st.network_us);
+            json_field(out, "reorder_us", st.reorder_us);
+            json_field(out, "output_us", st.output_us);
+            json_field(out, "end_to_end_us", st.end_to_end_us);
+            out.append("}");
+        }
+        out.append("]}");
+    }
+
+    /* reads the counter of an eventfd or a timerfd */
+    static void drain_fd(int fd) {
+        uint64_t val;
+        if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+            LOG_ERROR("Error: control read, errno = " << errno);
+    }
+
+    void arm_expiry() {
+        struct itimerspec when = {};
+        when.it_value.tv_sec = directory.next_expiry(DISCONNECT_INTERVAL);
+        if (timerfd_settime(expiry_fd, TFD_TIMER_ABSTIME, &when, nullptr) < 0)
+            LOG_ERROR("Error: expiry timer, errno = " << errno);
+    }
+
     void send_lookup() {
         if (sendto(lookup_tr_reply_rcv.sock, (void*)LOOKUP_MSG,
                    (size_t)LOOKUP_MSG_LEN, 0, (struct sockaddr *)&discover_addr,
                    sizeof(discover_addr)) == -1) {
-            std::cerr << "Error: reply sendto, errno = " << errno << "\n";
-            std::cerr << "bind: " << inet_ntoa(discover_addr.sin_addr)
-                      << " p: " << ntohs(discover_addr.sin_port) << "\n";
+            LOG_ERROR("Error: reply sendto, errno = " << errno);
+            LOG_DEBUG("bind: " << inet_ntoa(discover_addr.sin_addr)
+                      << " p: " << ntohs(discover_addr.sin_port));
         }
-        std::cerr << "sent\n";
+        LOG_DEBUG("sent");
     }
 
+    /* Handles the replies waiting on the socket. The first station starts
+     * playing as soon as its reply comes. */
     void receive_replies() {
-        int started_playing = 0;
-        time_t start = time(nullptr);
+        for (int n = 0; n < MAX_REPLIES_PER_WAKEUP; ++n) {
+            sockaddr_in addr, direct;
+            std::string name;
+            bool bin_rexmit = false;
 
-        while (true) {
-            do {
-                sockaddr_in addr, direct;
-                std::string name;
-
-                if (!receive_reply(addr, direct, name)) {
-                    std::cerr << "received reply\n";
-                    if (!started_playing) {
-                        if (station_name.empty()) {
-                            started_playing = 1;
-                        } else {
-                            if (name == station_name) {
-                                started_playing = 1;
-                            } else {
-                                continue;
-                            }
-                        }
-                    }
-                    std::cerr << "bef st mut replies" << "\n";
-                    stations_mut.lock();
-                    std::cerr << "in st mut replies" << "\n";
-                    station_det del_station = {0};
-                    if (handle_stations_update(addr, direct, name, &del_station)) {
-                        name_mut.lock();
-                        if (del_station.name == station_name) {
-                            name_mut.unlock();
-                            std::cerr << "LIST upd "
-                                      << inet_ntoa(mcast_addr.sin_addr) << "\n";
-                            if (!stations.empty()) {
-                                set_new_station();
-                            }
-                        } else {
-                            name_mut.unlock();
-                        }
-                        unchanged_list.clear();
-                    }
-                    stations_mut.unlock();
-                    std::cerr << "out st mut replies" << "\n";
-                }
-            } while (true);
-        }
-    }
-
-    void delete_inactive_stations() { std::cerr << "in del inact" << "\n";
-        stations_mut.lock();
-        time_t now = time(nullptr);
-        station_det del_station = {0};
-        for (auto mi = stations.begin(); mi != stations.end();) {
-            for (auto li = mi->second.begin(); li != mi->second.end();) {
-                ++li;
-                if (now - std::prev(li)->last_answ > DISCONNECT_INTERVAL) {
-                    std::cerr << "deleting (name " << mi->first
-                              << " addr "
-                              << inet_ntoa(std::prev(li)->addr.sin_addr)
-                              << " port " << ntohs(std::prev(li)->addr.sin_port)
-                              << ")\n";
-                    del_station = *(std::prev(li));
-                    clean_rexmits(del_station.name);
-                    mi->second.erase(std::prev(li));
-                }
-            }
-            ++mi;
-            if (std::prev(mi)->second.empty()) {
-                std::cerr << "deleting name " << prev(mi)->first << "\n";
-                stations.erase(std::prev(mi));
+            int ret = receive_reply(addr, direct, name, bin_rexmit);
+            if (ret < 0)
+                break;
+            if (ret > 0)
+                continue;
+
+            if (!started_playing) {
+                if (station_name.empty() || name == station_name)
+                    started_playing = true;
+                else
+                    continue;
             }
-        }
-        std::cerr << "maintenance " << inet_ntoa(mcast_addr.sin_addr)
-                  << " " << ntohs(mcast_addr.sin_port) << "\n";
-        std::cerr << "m. played " << inet_ntoa(del_station.addr.sin_addr)
-                  << " " << ntohs(del_station.addr.sin_port) << "\n";
-        if (mcast_addr.sin_addr.s_addr == del_station.addr.sin_addr.s_addr &&
-            mcast_addr.sin_port == del_station.addr.sin_port) {
-            if (!stations.empty()) {
-                set_new_station();
+            station_det del_station = {};
+            if (directory.update(addr, direct, name, bin_rexmit,
+                                 time(nullptr), DISCONNECT_INTERVAL,
+                                 &del_station)) {
+                name_mut.lock();
+                if (del_station.name == station_name ||
+                    mcast_addr.sin_port == 0) {
+                    name_mut.unlock();
+                    set_new_station();
+                } else {
+                    name_mut.unlock();
+                }
+                list_changed();
+                update_standby_want();
+                arm_expiry();
             }
         }
-        stations_mut.unlock();
-        std::cerr << "out del inact" << "\n";
     }
 
-    void clean_rexmits(std::string &name) {
-        for (long i = rtime - 1; i >= 0; --i) {
-            rexmit_batch_mut[i].lock();
-            rexmit_batch[i].erase(name);
-            rexmit_batch_mut[i].unlock();
+    void delete_inactive_stations() {
+        station_det del_station = {};
+        auto deleted = directory.expire(time(nullptr), DISCONNECT_INTERVAL);
+        for (auto &sd : deleted) {
+            LOG_INFO("deleting (name " << sd.name << " addr "
+                     << inet_ntoa(sd.addr.sin_addr) << " port "
+                     << ntohs(sd.addr.sin_port) << ")");
+            if (!same_addr(mcast_addr, del_station.addr))
+                del_station = sd;
         }
+        if (same_addr(mcast_addr, del_station.addr))
+            set_new_station();
+        if (!deleted.empty())
+            list_changed();
+        update_standby_want();
+    }
+
+    void list_changed() {
+        uint64_t one = 1;
+        if (write(list_fd, &one, sizeof(one)) < 0)
+            LOG_ERROR("Error: list write, errno = " << errno);
     }
 
-    void set_new_station(struct station_det &station) {
+    void set_new_station(const station_det &station) {
         new_station_mut.lock();
-        std::cerr << "in 1 mutex\n";
-        keep_playing.clear();
-        keep_waiting.clear();
+        uint64_t one = 1;
+        if (write(switch_fd, &one, sizeof(one)) < 0)
+            LOG_ERROR("Error: switch write, errno = " << errno);
 
-        current_mut.lock();std::cerr << "in 2 mutex\n";
-        mcast_rcv.drop_mcast();
+        current_mut.lock();
+        // a promotion play() has not used yet holds packets of the station
+        // switched away from now, they must not stay with another socket
+        if (promoted >= 0) {
+            standby[promoted].clear();
+            promoted = -1;
+        }
+        int i = find_standby(station.addr);
+        if (i >= 0) { // already joined, the played station becomes a standby
+            std::swap(mcast_rcv.sock, standby[i].rcv.sock);
+            standby[i].addr = mcast_addr;
+            promoted = i;
+        } else {
+            mcast_rcv.drop_mcast();
+            mcast_rcv.prepare_to_receive_mcast(station.addr);
+            promoted = -1;
+        }
         mcast_addr = station.addr;
-        mcast_rcv.prepare_to_receive_mcast(station.addr);
 
         name_mut.lock();
         station_name = station.name;
         name_mut.unlock();
+        list_changed();
 
         direct_mut.lock();
         direct_addr = station.direct;
+        direct_bin_rexmit = station.bin_rexmit;
         direct_mut.unlock();
 
-        current_mut.unlock();std::cerr << "out 1 mutex\n";
+        current_mut.unlock();
 
-        new_station_mut.unlock();std::cerr << "out 2 mutex\n";
+        update_standby_want(station.name);
+        new_station_mut.unlock();
     }
 
-    void set_new_station() {
-        if (!stations.empty() && !stations.begin()->second.empty())
-            set_new_station(stations.begin()->second.front());
-    }
-
-    /* returns 1 if station list changes, 0 otherwise */
-    int handle_stations_update(sockaddr_in &addr, sockaddr_in &direct,
-                               std::string &name, station_det *del_station) {
-        std::cerr << "handle in" << "\n";
-        time_t now = time(nullptr);
-        if (stations.count(name)) {
-            for (auto li = stations[name].begin();
-                    li != stations[name].end();
-                    ++li) {
-                struct station_det &sd = *li;
-                if (sd.addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
-                    sd.addr.sin_port == addr.sin_port) {
-                    if (now - sd.last_answ > DISCONNECT_INTERVAL) {
-                        *del_station = sd;
-                        stations[name].erase(li);
-                        std::cerr << "del station " << inet_ntoa(addr.sin_addr)
-                                  << "\n";
-                        if (stations[name].empty())
-                            stations.erase(name);
-                        return 1;
-                    } else {
-                        sd.last_answ = now;
-                        sd.direct = direct;
-                        sd.name = name;
-                        std::cerr << "upd station " << name << "\n";
-                        return 0;
-                    }
-                }
+    /* Picks the stations around the given one in the list to be kept on
+     * standby, play() joins them. */
+    void update_standby_want(const std::string &name) {
+        if (!warm_standby)
+            return;
+
+        std::vector<sockaddr_in> want;
+        auto stations = directory.get();
+        auto mi = stations->find(name);
+        if (mi != stations->end()) {
+            if (mi != stations->begin() && !std::prev(mi)->second.empty())
+                want.push_back(std::prev(mi)->second.front().addr);
+            if (std::next(mi) != stations->end() &&
+                !std::next(mi)->second.empty())
+                want.push_back(std::next(mi)->second.front().addr);
+        }
+
+        standby_mut.lock();
+        standby_want = want;
+        standby_mut.unlock();
+
+        uint64_t one = 1;
+        if (write(standby_fd, &one, sizeof(one)) < 0)
+            LOG_ERROR("Error: standby write, errno = " << errno);
+    }
+
+    void update_standby_want() {
+        name_mut.lock();
+        std::string name = station_name;
+        name_mut.unlock();
+        update_standby_want(name);
+    }
+
+    static bool same_addr(const sockaddr_in &a, const sockaddr_in &b) {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    /* Requires current_mut. */
+    int find_standby(const sockaddr_in &addr) {
+        for (int i = 0; i < STANDBY_NUM; ++i)
+            if (standby[i].active() && same_addr(standby[i].addr, addr))
+                return i;
+        return -1;
+    }
+
+    /* Joins the wanted standby stations and leaves the others.
+     * Requires current_mut. */
+    void reconcile_standby(int epoll_fd) {
+        standby_mut.lock();
+        std::vector<sockaddr_in> want = standby_want;
+        standby_mut.unlock();
+
+        for (int i = 0; i < STANDBY_NUM; ++i) {
+            if (!standby[i].active())
+                continue;
+            bool wanted = false;
+            for (auto &addr : want)
+                wanted = wanted || same_addr(addr, standby[i].addr);
+            if (!wanted) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, standby[i].rcv.sock, nullptr);
+                standby[i].leave();
             }
-        } else {
-            struct station_det sd = {addr, direct, name, now};
-            stations[name].push_back(sd);
-            std::cerr << "add station " << name << inet_ntoa(addr.sin_addr)
-                      << " " << ntohs(addr.sin_port)
-                      << " direct " << inet_ntoa(direct.sin_addr)
-                      << " " << ntohs(direct.sin_port) << "\n";
-            return 1;
         }
+
+        for (auto &addr : want) {
+            if (same_addr(addr, mcast_addr) || find_standby(addr) >= 0)
+                continue;
+            for (int i = 0; i < STANDBY_NUM; ++i) {
+                if (standby[i].active())
+                    continue;
+                if (!standby[i].join(addr, bsize))
+                    watch_standby(epoll_fd, i, EPOLL_CTL_ADD);
+                break;
+            }
+        }
+    }
+
+    void watch_standby(int epoll_fd, int i, int op) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = standby[i].rcv.sock;
+        if (epoll_ctl(epoll_fd, op, standby[i].rcv.sock, &ev) < 0)
+            LOG_ERROR("Error: standby epoll_ctl, errno = " << errno);
+    }
+
+    void set_new_station() {
+        auto stations = directory.get();
+        if (!stations->empty() && !stations->begin()->second.empty())
+            set_new_station(stations->begin()->second.front());
     }
 
-    int receive_reply(sockaddr_in &addr, sockaddr_in &direct, std::string &name) {
+    /* returns -1 if there is nothing to receive, 1 if the reply is invalid,
+     * 0 otherwise */
+    int receive_reply(sockaddr_in &addr, sockaddr_in &direct, std::string &name,
+                      bool &bin_rexmit) {
         char buffer[MAX_CTRL_MSG_LEN];
-        // sockaddr_in rcv_addr;
         socklen_t rcv_addr_len = (socklen_t)sizeof(direct);
         ssize_t rcv_len = recvfrom(lookup_tr_reply_rcv.sock, (void *)&buffer,
-                sizeof(buffer), 0, (struct sockaddr *)&direct, &rcv_addr_len);
+                sizeof(buffer) - 1, 0, (struct sockaddr *)&direct, &rcv_addr_len);
 
         if (rcv_len > 0) {
-            int err = 0;
             buffer[rcv_len] = '\0';
-
-            return parse_reply(buffer, addr, name);
+            return parse_reply(buffer, addr, name, bin_rexmit);
         }
+        if (rcv_len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            LOG_ERROR("Error: reply recvfrom, errno = " << errno);
 
-        return 1;
+        return rcv_len < 0 ? -1 : 1;
     }
 
-    int parse_reply(char *reply_str, sockaddr_in &addr, std::string &name) {
+    int parse_reply(char *reply_str, sockaddr_in &addr, std::string &name,
+                    bool &bin_rexmit) {
         int err = 0;
         strtok(reply_str, " ");
         char *token = strtok(nullptr, " ");
@@ -351,12 +625,13 @@ protected:
         //BOREWICZ_HERE [MCAST_ADDR] [DATA_PORT] [nazwa stacji]
         if (!inet_pton(AF_INET, token, &addr.sin_addr)) {
             err = 1;
-        } else { std::cerr<<"repl inet_pton: " << token << "\n";
+        } else {
+            LOG_DEBUG("repl inet_pton: " << token);
             std::string port_str(strtok(nullptr, " "));
-            std::cerr << "port str " << port_str << "\n";
+            LOG_DEBUG("port str " << port_str);
             try {
                 uint32_t port = (uint32_t)std::stoi(port_str);
-                 std::cerr << "port network ord " << port << "\n";
+                LOG_DEBUG("port network ord " << port);
                 if (ntohs(port) <= 0 || ntohs(port) > 65536)
                     err = 1;
                 else addr.sin_port = (in_port_t)port;
@@ -365,238 +640,850 @@ protected:
             }
         }
 
-        if (!err) { std::cerr << "rpl port: " << addr.sin_port << "\n";
+        if (!err) {
+            LOG_DEBUG("rpl port: " << addr.sin_port);
             token = strtok(nullptr, "\n");
             if (token == nullptr || strlen(token) > MAX_NAME_LEN)
                 err = 1;
             else {
                 name = std::string(token);
-                std::cerr << "rpl name: " << name << "\n";
+                LOG_DEBUG("rpl name: " << name);
             }
         }
 
+        if (!err) { // optional capability line following the reply
+            token = strtok(nullptr, "\n");
+            bin_rexmit = token != nullptr && !strcmp(token, REXMIT_BIN_CAP);
+        }
+
         return err;
     }
 
+    /* Network stage of playing: receives, reorders and repairs the stream
+     * and hands the packets due to be played over to output(). */
     int play() {
-        while (keep_waiting.test_and_set()) {
+        pin_thread(net_cpu, "play");
+        int epoll_fd = epoll_create1(0);
+        if (epoll_fd < 0) {
+            LOG_ERROR("Error: play epoll_create, errno = " << errno);
+            return 1;
         }
 
-        int initialized = 0, play = 0, end = 0;
-        char buffer[MAX_UDP_MSG_LEN];
-        uint64_t session_id, byte_zero;
-        uint64_t max_id_read;
-        struct pollfd polled[2];
-        polled[0].fd = STDOUT_FILENO;
-        polled[0].events = POLLOUT;
-        polled[1].events = POLLIN;
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = switch_fd;
+        int err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, switch_fd, &ev);
+        ev.data.fd = standby_fd;
+        if (err < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, standby_fd, &ev) < 0) {
+            LOG_ERROR("Error: play epoll_ctl, errno = " << errno);
+            close(epoll_fd);
+            return 1;
+        }
 
         while (true) {
-            initialized = 0;
-            play = 0;
-            end = 0;
-            last_id_written = 0;
-            audiogram a(0, true);
+            wait_output(); // the buffer is reused by the next session
+            new_station_mut.lock(); // let a pending switch finish first
+            new_station_mut.unlock();
+            current_mut.lock();
+            name_mut.lock();
+            std::string name = station_name;
+            name_mut.unlock();
+            stats = &stats_of(name);
 
-            new_station_mut.lock();std::cerr<<"in newstmut\n";
-            new_station_mut.unlock();std::cerr<<"after newstmut\n";
-            current_mut.lock();std::cerr<<"in mcastmut\n";
+            for (int i = 0; i < STANDBY_NUM; ++i)
+                if (standby[i].active())
+                    watch_standby(epoll_fd, i, EPOLL_CTL_ADD);
 
-            polled[1].fd = mcast_rcv.sock;
+            play_session(epoll_fd);
+            discard_to = handed_total;
 
-            while (!end) {
-                if (!keep_playing.test_and_set()) {
-                    break;
-                }
+            for (int i = 0; i < STANDBY_NUM; ++i)
+                if (standby[i].active())
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, standby[i].rcv.sock,
+                              nullptr);
+            current_mut.unlock();
+        }
+    }
+
+    /* Plays the current station until it is switched or playing has to be
+     * started again. Sleeps in epoll_wait whenever there is nothing to do. */
+    void play_session(int epoll_fd) {
+        struct epoll_event events[MAX_PLAY_EVENTS];
+        char buffer[MAX_UDP_MSG_LEN];
+        int sock = mcast_rcv.sock, initialized = 0, play = 0, end = 0;
+        bool switched = false, stalled = false;
+        uint64_t session_id = 0, byte_zero = 0, max_id_read = 0;
+        uint64_t started_at = 0; // arrival of the first packet
 
+        last_id_written = 0;
+        out_id = 0;
+        kernel_rx_ns = 0; // not known for packets kept on standby
+        reset_fec();
+        delay.restart();
+
+        if (sock >= 0) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = sock;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+                LOG_ERROR("Error: play epoll_ctl, errno = " << errno);
+                sock = -1;
+            }
+        }
+
+        if (promoted >= 0) { // start from what the standby has received
+            standby_station &st = standby[promoted];
+            uint64_t since = playout_delay::now() - delay.target();
+            for (size_t i = st.first_since(since); i < st.size() && !end; ++i) {
+                arrival_ns = st.arrival(i);
                 if (!initialized) {
-                    if (!uninitialized_recv(buffer, a)) {
-                        session_id = a.get_session_id();
-                        byte_zero = a.get_packet_id();
-                        max_id_read = byte_zero;
-                        audio_buf[0] = a;
-                        out_id = 0;
-                        initialized = 1;
-                    }
+                    if (first_packet(st.packet(i), st.packet_size()))
+                        continue;
+                    begin_session(st.packet(i), session_id, byte_zero,
+                                  max_id_read, started_at);
+                    initialized = 1;
+                } else if (handle_new_audiogram(session_id, byte_zero,
+                                                max_id_read, st.packet(i), -1)) {
+                    end = 1;
+                }
+            }
+            st.clear();
+            promoted = -1;
+        }
+        reconcile_standby(epoll_fd);
+
+        while (!end) {
+            if (play) {
+                bool full = hand_out();
+                uint64_t ahead = (max_id_read - byte_zero) / psize + 1 - out_id;
+                stats->occupancy.record(ahead);
+                // the packet at out_id is missing, not waiting for stdout
+                bool missing = ahead > 0 && !full && !audio_buf.is_fresh(out_id);
+                if (missing && !stalled)
+                    stats->underruns.add();
+                stalled = missing;
+            }
+
+            int timeout = -1;
+            if (initialized && !play) { // wake up when enough is buffered
+                uint64_t start_at = started_at + delay.target(),
+                        t = playout_delay::now();
+                if (start_at <= t) {
+                    play = 1;
                     continue;
                 }
+                timeout = (int)((start_at - t + 999999) / 1000000);
+            }
 
-                if (!play) {
-                    ssize_t rcv_len = read(mcast_rcv.sock,
-                            (void *)a.get_packet_data(), psize);
-                    if (rcv_len < 0) {
-                        continue;
-                    }
-                    if (handle_new_audiogram(session_id,
-                                             byte_zero, max_id_read, a)) {
-                        break;
+            int ev_num = epoll_wait(epoll_fd, events, MAX_PLAY_EVENTS, timeout);
+            if (ev_num < 0) {
+                if (errno == EINTR)
+                    continue;
+                LOG_ERROR("Error: play epoll_wait, errno = " << errno);
+                break;
+            }
+
+            for (int i = 0; i < ev_num && !end; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == switch_fd) {
+                    uint64_t val;
+                    if (read(switch_fd, &val, sizeof(val)) < 0)
+                        LOG_ERROR("Error: switch read, errno = " << errno);
+                    end = 1;
+                    switched = true;
+                } else if (fd == standby_fd) {
+                    uint64_t val;
+                    if (read(standby_fd, &val, sizeof(val)) < 0)
+                        LOG_ERROR("Error: standby read, errno = " << errno);
+                    reconcile_standby(epoll_fd);
+                } else if (fd == sock) {
+                    if (!initialized) {
+                        if (uninitialized_recv(buffer))
+                            continue;
+                        arrival_ns = playout_delay::now();
+                        begin_session((uint8_t *)buffer, session_id, byte_zero,
+                                      max_id_read, started_at);
+                        initialized = 1;
                     }
-                    if (a.get_packet_id() >=
-                        byte_zero + psize * audio_buf.capacity() * 3 / 4) {
+                    if (receive_batch(session_id, byte_zero, max_id_read))
+                        end = 1;
+                    // the buffer is filling up, waiting longer would overflow it
+                    if (max_id_read >=
+                        byte_zero + psize * audio_buf.capacity() * 3 / 4)
                         play = 1;
-                    }
                 } else {
-                    polled[0].revents = 0;
-                    polled[1].revents = 0;
+                    for (int j = 0; j < STANDBY_NUM; ++j)
+                        if (standby[j].active() && fd == standby[j].rcv.sock)
+                            standby[j].receive(playout_delay::now(),
+                                               MAX_READS_PER_WAKEUP);
+                }
+            }
+        }
 
-                    int poll_num = poll(polled, 2, 0);
-                    switch (poll_num) {
-                    case 0:
-                        continue;
-                    case 1:
-                    case 2:
-                        if (polled[0].revents & POLLOUT) {
-                            if (!audio_buf[out_id].is_fresh()) {
-                                std::cerr<<"REASON2";
-                                end = true;
-                                continue;
-                            }
-                            std::cout.write(
-                                    (char *)audio_buf[out_id].get_audio_data(),
-                                    psize - audiogram::HEADER_SIZE);
-                            audio_buf[out_id].set_fresh(false);
-                            last_id_written = audio_buf[out_id].get_packet_id();
-                            out_id = (out_id + 1) % audio_buf.capacity();
-                        }
-                        if (polled[1].revents & POLLIN) {
-                            a.set_size(psize);
-                            ssize_t rcv_len = read(mcast_rcv.sock,
-                                    (void *)a.get_packet_data(), psize);
-                            if (rcv_len < 0) {
-                                std::cerr << "Error: receiver read, errno = "
-                                          << errno << "\n";
-                                continue;
-                            }
-
-                            if (handle_new_audiogram(session_id, byte_zero,
-                                                     max_id_read, a)) {
-                                end = true;
-                                break;
-                            }
-                        }
-                    }
+        if (sock >= 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+        if (end && !switched)
+            stats->restarts.add();
+    }
+
+    /* starts a session with its first packet, received at arrival_ns */
+    void begin_session(const uint8_t *packet, uint64_t &session_id,
+                       uint64_t &byte_zero, uint64_t &max_id_read,
+                       uint64_t &started_at) {
+        session_id = audiogram::session_id_of(packet);
+        byte_zero = audiogram::packet_id_of(packet);
+        stamped = audiogram::has_timestamp(packet);
+        max_id_read = byte_zero;
+        audio_buf.store(packet, 0);
+        started_at = arrival_ns;
+        delay.on_arrival(started_at, 0);
+        reset_losses(byte_zero);
+    }
+
+    /* forgets requests of the previous session, their packets are gone */
+    void reset_losses(uint64_t byte_zero) {
+        loss_mut.lock();
+        ++loss_generation;
+        losses.init(byte_zero, psize, audio_buf.capacity());
+        loss_mut.unlock();
+    }
+
+    /* Reads packets in batches of RECV_BATCH straight into the spare slots
+     * of the reorder buffer until the socket is drained or enough has been
+     * read for one wakeup. Every packet arrives at its own kernel receive
+     * time, so the jitter within a batch is not lost.
+     * returns 1 if playing needs to be started again, 0 otherwise */
+    int receive_batch(uint64_t session_id, uint64_t byte_zero,
+                      uint64_t &max_id_read) {
+        struct mmsghdr msgs[RECV_BATCH];
+        struct iovec iovs[RECV_BATCH];
+        char control[RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+        unsigned batch = (unsigned)std::min((size_t)RECV_BATCH,
+                                            audio_buf.spares());
+
+        for (int r = 0; r < MAX_READS_PER_WAKEUP; r += batch) {
+            memset(msgs, 0, sizeof(msgs));
+            for (unsigned i = 0; i < batch; ++i) {
+                iovs[i].iov_base = audio_buf.spare_at(i);
+                iovs[i].iov_len = psize;
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_control = control[i];
+                msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+            }
+
+            int got = recvmmsg(mcast_rcv.sock, msgs, batch, MSG_DONTWAIT,
+                               nullptr);
+            // kernel receive times are of CLOCK_REALTIME, arrivals are not
+            uint64_t batch_ns = playout_delay::now();
+            uint64_t wall_ns = audiogram::wall_clock_ns();
+            arrival_ns = batch_ns;
+            if (got <= 0) {
+                if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR)
+                    LOG_ERROR("Error: recvmmsg, errno = " << errno);
+                return 0;
+            }
+
+            for (int i = 0; i < got; ++i) {
+                if (msgs[i].msg_len != psize ||
+                    (msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+                    continue;
+                stats->received.add();
+                kernel_rx_ns = rx_time(msgs[i].msg_hdr);
+                arrival_ns = batch_ns;
+                if (kernel_rx_ns != 0 && kernel_rx_ns <= wall_ns &&
+                    wall_ns - kernel_rx_ns < batch_ns)
+                    arrival_ns = batch_ns - (wall_ns - kernel_rx_ns);
+                if (handle_new_audiogram(session_id, byte_zero, max_id_read,
+                                         audio_buf.spare_at((size_t)i), i))
+                    return 1;
+            }
+            if ((unsigned)got < batch)
+                return 0;
+        }
+
+        return 0;
+    }
+
+    /* kernel receive time of a message in ns of CLOCK_REALTIME, the clock
+     * of the timestamps, 0 if it came without one */
+    static uint64_t rx_time(struct msghdr &hdr) {
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&hdr); c != nullptr;
+             c = CMSG_NXTHDR(&hdr, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+            }
+        }
+        return 0;
+    }
+
+    /* hands the run of ready packets starting at out_id over to output(),
+     * returns true if out_q was too full to take all the ready ones */
+    bool hand_out() {
+        uint32_t slots[MAX_WRITE_PACKETS];
+        size_t pushed = 0;
+        uint64_t now = stamped ? audiogram::wall_clock_ns() : 0;
+        bool full = false;
+
+        while (true) {
+            size_t num = 0;
+            while (num < (size_t)MAX_WRITE_PACKETS &&
+                   audio_buf.is_fresh(out_id + num)) {
+                slots[num] = audio_buf.slot_of(out_id + num);
+                if (stamped)
+                    handed_ns[slots[num]] = now;
+                ++num;
+            }
+            size_t ready = num;
+            num = out_q.push(slots, num);
+            full = num < ready;
+            if (num == 0)
+                break;
+            for (size_t i = 0; i < num; ++i) {
+                audio_buf.set_fresh(out_id + i, false);
+                uint64_t rx = stamped ? rx_ns[(out_id + i) % rx_ns.size()] : 0;
+                if (rx != 0 && now >= rx)
+                    stats->reorder_us.record((now - rx) / 1000);
+            }
+            out_id += num;
+            handed_total += num;
+            pushed += num;
+        }
+
+        uint64_t one = 1;
+        if (pushed > 0 && write(out_fd, &one, sizeof(one)) < 0)
+            LOG_ERROR("Error: out write, errno = " << errno);
+        return full;
+    }
+
+    /* first packet of the session not written out yet, packets from it up
+     * to out_id are in the hands of output() */
+    uint64_t first_unwritten() {
+        return out_id - (handed_total - written_total.load());
+    }
+
+    /* waits until output() is done with every packet handed to it */
+    void wait_output() {
+        while (written_total.load() != handed_total) {
+            uint64_t val;
+            if (read(done_fd, &val, sizeof(val)) < 0 && errno != EINTR)
+                LOG_ERROR("Error: done read, errno = " << errno);
+        }
+    }
+
+    static void pin_thread(int cpu, const char *name) {
+        if (cpu < 0)
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+            LOG_ERROR("Error: pinning " << name << " to cpu " << cpu
+                      << ", errno = " << err);
+    }
+
+    /* Output stage of playing: writes the packets handed over by play() to
+     * stdout, so a slow reader of stdout holds up this thread only and
+     * never the socket. */
+    void output() {
+        pin_thread(out_cpu, "output");
+        uint32_t slots[MAX_WRITE_PACKETS];
+        uint64_t taken = 0; // packets taken off out_q
+
+        while (true) {
+            uint64_t val;
+            if (read(out_fd, &val, sizeof(val)) < 0) {
+                if (errno != EINTR)
+                    LOG_ERROR("Error: out read, errno = " << errno);
+                continue;
+            }
+
+            size_t num;
+            while ((num = out_q.pop(slots, MAX_WRITE_PACKETS)) > 0) {
+                uint64_t skip = discard_to.load();
+                size_t first = skip > taken ? (size_t)std::min(skip - taken,
+                                                               (uint64_t)num) : 0;
+                write_out(slots + first, num - first);
+                time_output(slots + first, num - first);
+                taken += num;
+                written_total += num;
+
+                uint64_t one = 1;
+                if (write(done_fd, &one, sizeof(one)) < 0)
+                    LOG_ERROR("Error: done write, errno = " << errno);
+            }
+        }
+    }
+
+    /* writes the payloads of the packets in the given slots with a single
+     * writev, waits for stdout if it is nonblocking and full */
+    void write_out(const uint32_t *slots, size_t num) {
+        struct iovec iovs[MAX_WRITE_PACKETS];
+        size_t first = 0;
+
+        for (size_t i = 0; i < num; ++i) {
+            uint8_t *packet = audio_buf.slot_data(slots[i]);
+            size_t offset = audiogram::data_offset(packet);
+            iovs[i].iov_base = packet + offset;
+            iovs[i].iov_len = psize - offset;
+        }
+
+        while (first < num) {
+            ssize_t ret = writev(STDOUT_FILENO, iovs + first, (int)(num - first));
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    struct pollfd out = {STDOUT_FILENO, POLLOUT, 0};
+                    poll(&out, 1, -1);
+                    continue;
                 }
+                LOG_ERROR("Error: receiver writev, errno = " << errno);
+                break;
+            }
+            size_t written = (size_t)ret;
+            while (first < num && written >= iovs[first].iov_len)
+                written -= iovs[first++].iov_len;
+            if (first < num) { // partial write
+                iovs[first].iov_base = (char *)iovs[first].iov_base + written;
+                iovs[first].iov_len -= written;
             }
-            current_mut.unlock();
         }
+
+        if (num > 0)
+            last_id_written = audiogram::packet_id_of(audio_buf.slot_data(slots[num - 1]));
     }
 
-    /* returns 1 if playing needs to be started again, 0 otherwise */
+    /* records how long the timestamped packets in the given slots, just
+     * written, waited for output and took from being sent */
+    void time_output(const uint32_t *slots, size_t num) {
+        uint64_t now = audiogram::wall_clock_ns();
+        for (size_t i = 0; i < num; ++i) {
+            const uint8_t *packet = audio_buf.slot_data(slots[i]);
+            if (!audiogram::has_timestamp(packet))
+                continue;
+            uint64_t sent = audiogram::timestamp_of(packet);
+            if (now >= handed_ns[slots[i]])
+                stats->output_us.record((now - handed_ns[slots[i]]) / 1000);
+            if (now >= sent) // clocks of the two hosts may differ
+                stats->end_to_end_us.record((now - sent) / 1000);
+        }
+    }
+
+    /* Validates a packet and publishes it in the reorder buffer, from the
+     * given spare slot if it was received into one (spare >= 0).
+     * returns 1 if playing needs to be started again, 0 otherwise */
     int handle_new_audiogram(uint64_t session_id, uint64_t byte_zero,
-                             uint64_t &max_id_read, audiogram &a) {
-        if (session_id > a.get_session_id())
+                             uint64_t &max_id_read, const uint8_t *packet,
+                             int spare) {
+        uint64_t packet_session = audiogram::session_id_of(packet);
+        if (packet_session < session_id)
+            return 0;
+        if (packet_session > session_id) // transmitter restarted
             return 1;
 
-        uint64_t packet_id = a.get_packet_id();
-        if (packet_id <= byte_zero)
+        uint64_t packet_id = audiogram::packet_id_of(packet);
+        if (fec::is_parity(packet_id))
+            return handle_parity(session_id, byte_zero, max_id_read, packet);
+        if (packet_id < byte_zero)
             return 0;
         if (((packet_id - byte_zero) % psize) != 0)
             return 0;
-        unsigned long buf_id = (packet_id - byte_zero) / psize;
-        if (buf_id >= audio_buf.capacity() + out_id) { std::cerr<<"REASON1";
-            return 1;
+        uint64_t buf_id = (packet_id - byte_zero) / psize;
+        if (buf_id < out_id) { // played already
+            stats->duplicates.add();
+            return 0;
         }
-        buf_id = ((packet_id - byte_zero) / psize) % audio_buf.capacity();
+        // output fell too far behind, the slot may still be being written
+        if (buf_id >= first_unwritten() + audio_buf.capacity())
+            return 1;
 
         if (packet_id > max_id_read + psize) {
-            for (unsigned long i =
-                    (max_id_read / psize) % audio_buf.capacity() + 1; // max idx
-                    i < buf_id;
-                    ++i)
-                audio_buf[i].set_fresh(false);
-            add_rexmit(max_id_read + psize, packet_id - psize);
-        }
-        if (packet_id >= max_id_read + psize)
+            stats->gaps.add();
+            stats->lost.add((packet_id - max_id_read) / psize - 1);
+            for (uint64_t id = max_id_read + psize; id < packet_id; id += psize)
+                gap_found[((id - byte_zero) / psize) % gap_found.size()] =
+                        arrival_ns;
+            if (fec_k)
+                fec_pending.push_back({max_id_read + psize, packet_id - psize});
+            else
+                add_rexmit(max_id_read + psize, packet_id - psize);
+        }
+        // a packet asked for again may be a resent one, late by the repair
+        bool asked = stamped && losses.is_missing(packet_id);
+        if (packet_id > max_id_read) {
+            delay.on_arrival(arrival_ns, (packet_id - max_id_read) / psize);
             max_id_read = packet_id;
+        } else if (!has_packet(byte_zero, packet_id)) {
+            delay.on_repair((max_id_read - packet_id) / psize);
+            if (spare >= 0 && losses.is_missing(packet_id))
+                count_repair(stats->repaired_rexmit, buf_id, true);
+        } else {
+            stats->duplicates.add();
+            return 0;
+        }
 
-        a.set_fresh(true);
-        audio_buf[buf_id] = a;
+        if (spare >= 0)
+            audio_buf.publish((size_t)spare, buf_id);
+        else
+            audio_buf.store(packet, buf_id);
+        losses.set_arrived(packet_id);
+        if (stamped)
+            time_arrival(packet, buf_id, spare < 0 || asked);
+
+        if (fec_k) {
+            if (try_recover(session_id, byte_zero, max_id_read,
+                            block_first(packet_id)))
+                return 1;
+            // parity of earlier blocks would have arrived by now
+            release_fec_pending(byte_zero, block_first(packet_id));
+        }
 
         return 0;
     }
 
+    /* keeps when a packet came for its reorder wait and records its network
+     * latency unless it is a repair */
+    void time_arrival(const uint8_t *packet, uint64_t buf_id, bool repair) {
+        rx_ns[buf_id % rx_ns.size()] = kernel_rx_ns;
+        if (kernel_rx_ns == 0 || repair || !audiogram::has_timestamp(packet))
+            return;
+        uint64_t sent = audiogram::timestamp_of(packet);
+        if (kernel_rx_ns >= sent) // clocks of the two hosts may differ
+            stats->network_us.record((kernel_rx_ns - sent) / 1000);
+    }
+
+    /* a missing packet got repaired, its gap was found unless it was
+     * rebuilt before any later packet came */
+    void count_repair(counter &repaired, uint64_t buf_id, bool found) {
+        repaired.add();
+        uint64_t at = found ? gap_found[buf_id % gap_found.size()] : arrival_ns;
+        if (arrival_ns >= at)
+            stats->repair_us.record((arrival_ns - at) / 1000);
+    }
+
+    void reset_fec() {
+        fec_k = 0;
+        parity_buf.clear();
+        fec_pending.clear();
+    }
+
+    uint64_t block_first(uint64_t packet_id) {
+        return packet_id / (psize * fec_k) * (psize * fec_k);
+    }
+
+    /* returns 1 if playing needs to be started again, 0 otherwise */
+    int handle_parity(uint64_t session_id, uint64_t byte_zero,
+                      uint64_t &max_id_read, const uint8_t *packet) {
+        uint64_t packet_id = audiogram::packet_id_of(packet);
+        size_t k = fec::block_len(packet_id);
+        uint64_t first = fec::block_first(packet_id);
+        if (k < 2 || k > fec::MAX_BLOCK)
+            return 0;
+
+        if (k != fec_k) {
+            fec_k = k;
+            parity_buf = std::vector<audiogram>(
+                    audio_buf.capacity() / k + 2, audiogram(psize, false));
+        }
+        audiogram &parity = parity_buf[(first / psize / k) % parity_buf.size()];
+        memcpy(parity.get_packet_data(), packet, psize);
+        parity.set_fresh(true);
+
+        if (try_recover(session_id, byte_zero, max_id_read, first))
+            return 1;
+        release_fec_pending(byte_zero, first + psize * k);
+        return 0;
+    }
+
+    bool has_packet(uint64_t byte_zero, uint64_t packet_id) {
+        if (packet_id < byte_zero)
+            return false;
+        return audiogram::packet_id_of(
+                audio_buf.at((packet_id - byte_zero) / psize)) == packet_id;
+    }
+
+    /* rebuilds the packet missing from the block starting with first_id if
+     * it is the only one missing and the parity has arrived,
+     * returns 1 if playing needs to be started again, 0 otherwise */
+    int try_recover(uint64_t session_id, uint64_t byte_zero,
+                    uint64_t &max_id_read, uint64_t first_id) {
+        audiogram &parity =
+                parity_buf[(first_id / psize / fec_k) % parity_buf.size()];
+        if (!parity.is_fresh() ||
+            fec::block_first(parity.get_packet_id()) != first_id)
+            return 0;
+
+        uint64_t missing = 0;
+        size_t missing_num = 0;
+        for (size_t i = 0; i < fec_k && missing_num < 2; ++i) {
+            uint64_t id = first_id + i * psize;
+            if (!has_packet(byte_zero, id)) {
+                missing = id;
+                ++missing_num;
+            }
+        }
+        if (missing_num != 1 || missing <= byte_zero ||
+            (missing - byte_zero) / psize < out_id)
+            return 0;
+
+        const size_t payload = psize - audiogram::HEADER_SIZE;
+        audiogram rebuilt(psize, true);
+        audiogram::write_header(rebuilt.get_packet_data(),
+                                parity.get_session_id(), missing, stamped);
+        memcpy(rebuilt.get_audio_data(), parity.get_audio_data(), payload);
+        for (size_t i = 0; i < fec_k; ++i) {
+            uint64_t id = first_id + i * psize;
+            if (id != missing)
+                fec::xor_into(rebuilt.get_audio_data(),
+                              audio_buf.at((id - byte_zero) / psize) +
+                                      audiogram::HEADER_SIZE,
+                              payload);
+        }
+        parity.set_fresh(false);
+        count_repair(stats->repaired_fec, (missing - byte_zero) / psize,
+                     missing < max_id_read);
+
+        return handle_new_audiogram(session_id, byte_zero, max_id_read,
+                                    rebuilt.get_packet_data(), -1);
+    }
+
+    /* requests retransmission of what is still missing from gaps lying
+     * wholly before the given packet id */
+    void release_fec_pending(uint64_t byte_zero, uint64_t before_id) {
+        for (auto it = fec_pending.begin(); it != fec_pending.end();) {
+            if (it->second >= before_id) {
+                ++it;
+                continue;
+            }
+
+            uint64_t run_start = 0;
+            bool in_run = false;
+            for (uint64_t id = it->first; id <= it->second; id += psize) {
+                bool missing = !has_packet(byte_zero, id);
+                if (missing && !in_run) {
+                    run_start = id;
+                    in_run = true;
+                } else if (!missing && in_run) {
+                    add_rexmit(run_start, id - psize);
+                    in_run = false;
+                }
+            }
+            if (in_run)
+                add_rexmit(run_start, it->second);
+
+            it = fec_pending.erase(it);
+        }
+    }
+
     void add_rexmit(uint64_t min, uint64_t max) {
         if (min <= max) {
-            struct timeval moment;
-            gettimeofday(&moment, nullptr);
-            int batch =
-                    (int)((moment.tv_sec * 1000 + moment.tv_usec / 1000) % rtime);
-            rexmit_batch_mut[batch].lock();
-            std::cerr << "ADDREXMIT " << min << " " << max << "\n";
-            rexmit_batch[batch][station_name]
-                    .push_back({min, max, psize, direct_addr});
-            rexmit_batch_mut[batch].unlock();
+            for (uint64_t id = min; id <= max; id += psize)
+                losses.set_missing(id);
+            LOG_DEBUG("ADDREXMIT " << min << " " << max);
+            if (!nack_q.push({min, max, psize, direct_addr, direct_bin_rexmit, 0,
+                              loss_generation})) {
+                LOG_WARN("retransmission queue full, gap dropped");
+                return;
+            }
+
+            uint64_t one = 1;
+            if (write(nack_fd, &one, sizeof(one)) < 0)
+                LOG_ERROR("Error: nack write, errno = " << errno);
         }
     }
 
+    static uint64_t now_ms() {
+        return playout_delay::now() / 1000000;
+    }
+
+    /* Sends requests for the gaps found by play() when they are due. A gap
+     * is asked for at once and then again after rtime, 2 rtime, 4 rtime...
+     * until all its packets arrive or get played. rexmit_fd is set to go off
+     * when the next request is due. */
     void send_rexmits() {
-        while (true) {
-            for (int i = 0; i < rtime; ++i) {
-                name_mut.lock();
-                std::string name = station_name;
-                name_mut.unlock();
-                rexmit_batch_mut[i].lock();
-
-                for (auto mi = rexmit_batch[i].begin();
-                        mi != rexmit_batch[i].end();) {
-                    std::string msg(REXMIT_MSG);
-                    for (auto li = mi->second.begin();
-                            li != mi->second.end();) {
-                        ++li;
-                        build_rexmit(msg, mi->first, name, li, mi);
-                    }
+        std::vector<rexmit_data> due;
+        uint64_t now = now_ms();
+        rexmit_data rd;
+        while (nack_q.pop(rd))
+            nack_wheel.add(now, rd);
 
-                    auto old_mi = mi;
-                    ++mi;
-                    if (msg.size() > strlen(REXMIT_MSG)) {
-                        msg.append("\n");
-                        std::cerr << msg;
-                        std::cerr << "send to "
-                                  << inet_ntoa(old_mi->second.front()
-                                                       .direct.sin_addr)
-                                  << " "
-                                  << ntohs(old_mi->second.front()
-                                                   .direct.sin_port)
-                                  << "\n";
-                        sendto(direct_tr.sock, (void *) msg.c_str(), msg.size(),
-                               0,
-                               (struct sockaddr *)&old_mi->second.front().direct,
-                               sizeof(old_mi->second.front().direct));
-                    } else {
-                        rexmit_batch[i].erase(old_mi->first);
-                    }
+        nack_wheel.advance(now, due);
+        if (!due.empty())
+            fire_rexmits(due, now, nack_wheel);
+
+        struct itimerspec when = {};
+        int64_t wait = nack_wheel.next_due(now_ms());
+        if (wait > 0) {
+            when.it_value.tv_sec = wait / 1000;
+            when.it_value.tv_nsec = (wait % 1000) * 1000000;
+        } else if (wait == 0) {
+            when.it_value.tv_nsec = 1; // 0 would disarm
+        }
+        if (timerfd_settime(rexmit_fd, 0, &when, nullptr) < 0)
+            LOG_ERROR("Error: rexmit timer, errno = " << errno);
+    }
+
+    /* sends requests for what is still missing of the due gaps and
+     * schedules the next ones */
+    void fire_rexmits(std::vector<rexmit_data> &due, uint64_t now,
+                      timer_wheel<rexmit_data> &wheel) {
+        std::list<rexmit_data> outstanding;
+
+        loss_mut.lock();
+        for (rexmit_data &rd : due)
+            if (rd.generation == loss_generation)
+                outstanding.push_back(rd);
+        prune_rexmits(outstanding);
+        loss_mut.unlock();
+
+        for (rexmit_data &rd : outstanding) {
+            rexmit_ids.add((rd.max - rd.min) / rd.psize + 1);
+            rexmit_data next = rd;
+            ++next.tries;
+            wheel.add(now + (rtime << std::min(rd.tries, (unsigned)MAX_BACKOFF_SHIFT)), next);
+        }
+
+        /* one message list per transmitter */
+        while (!outstanding.empty()) {
+            std::list<rexmit_data> to_one;
+            rexmit_data &first = outstanding.front();
+            for (auto li = outstanding.begin(); li != outstanding.end();) {
+                if (same_addr(li->direct, first.direct) && &*li != &first) {
+                    auto next = std::next(li);
+                    to_one.splice(to_one.end(), outstanding, li);
+                    li = next;
+                } else {
+                    ++li;
                 }
-                rexmit_batch_mut[i].unlock();
             }
+            to_one.splice(to_one.begin(), outstanding, outstanding.begin());
+
+            if (to_one.front().bin_rexmit)
+                send_bin_rexmit(to_one);
+            else
+                send_text_rexmit(to_one);
         }
     }
 
-    void build_rexmit(std::string &msg, const std::string &to_station_name,
-        std::string &cur_station_name, std::list<rexmit_data>::iterator &li,
-        std::unordered_map<std::string, std::list<rexmit_data>>::iterator &mi) {
+    void send_text_rexmit(std::list<rexmit_data> &rexmits) {
+        std::string msg(REXMIT_MSG);
+        for (auto li = rexmits.begin(); li != rexmits.end();) {
+            ++li;
+            build_rexmit(msg, rexmits, li);
+        }
+
+        msg.append("\n");
+        struct sockaddr_in &to = rexmits.front().direct;
+        LOG_DEBUG(msg.substr(0, msg.size() - 1));
+        LOG_DEBUG("send to " << inet_ntoa(to.sin_addr) << " "
+                  << ntohs(to.sin_port));
+        sendto(direct_tr.sock, (void *) msg.c_str(), msg.size(), 0,
+               (struct sockaddr *)&to, sizeof(to));
+        rexmit_msgs.add();
+    }
+
+    /* leaves only packets which are still missing and not played yet,
+     * requires loss_mut */
+    void prune_rexmits(std::list<rexmit_data> &rexmits) {
+        uint64_t played = last_id_written;
+
+        for (auto li = rexmits.begin(); li != rexmits.end();) {
+            rexmit_data rd = *li;
+            li = rexmits.erase(li);
+
+            bool in_run = false;
+            for (uint64_t id = rd.min; id <= rd.max; id += rd.psize) {
+                bool missing = losses.is_missing(id) &&
+                               (played == 0 || id > played);
+                if (missing && !in_run) {
+                    rexmits.insert(li, rd);
+                    std::prev(li)->min = id;
+                    in_run = true;
+                } else if (!missing && in_run) {
+                    std::prev(li)->max = id - rd.psize;
+                    in_run = false;
+                }
+            }
+            if (in_run)
+                std::prev(li)->max = rd.max;
+        }
+    }
+
+    void send_bin_rexmit(std::list<rexmit_data> &rexmits) {
+        std::vector<rexmit_msg::range> ranges;
+        for (rexmit_data &rd : rexmits)
+            ranges.push_back({rd.min, (rd.max - rd.min) / rd.psize + 1});
+
+        /* sort and merge, ranges from different sessions may overlap */
+        std::sort(ranges.begin(), ranges.end(),
+                  [](const rexmit_msg::range &a, const rexmit_msg::range &b) {
+                      return a.first < b.first;
+                  });
+        size_t merged = 0, rpsize = rexmits.front().psize;
+        for (size_t r = 1; r < ranges.size(); ++r) {
+            rexmit_msg::range &last = ranges[merged];
+            uint64_t last_end = last.first + last.count * rpsize;
+            if (ranges[r].first <= last_end) {
+                uint64_t end = ranges[r].first + ranges[r].count * rpsize;
+                if (end > last_end)
+                    last.count = (end - last.first) / rpsize;
+            } else {
+                ranges[++merged] = ranges[r];
+            }
+        }
+        ranges.resize(merged + 1);
+        rexmit_msg::split_long(ranges, rpsize);
+
+        struct sockaddr_in &to = rexmits.front().direct;
+        uint8_t msg[MAX_REXMIT_BIN_LEN];
+        size_t from = 0, len;
+        while (from < ranges.size()) {
+            from = rexmit_msg::encode(ranges, from, rpsize, msg, sizeof(msg),
+                                      len);
+            sendto(direct_tr.sock, (void *)msg, len, 0,
+                   (struct sockaddr *)&to, sizeof(to));
+            rexmit_msgs.add();
+        }
+    }
+
+    void build_rexmit(std::string &msg, std::list<rexmit_data> &rexmits,
+                      std::list<rexmit_data>::iterator &li) {
         rexmit_data &rd = *std::prev(li);
 
         for (uint64_t i = rd.min; i <= rd.max; i += rd.psize) {
             msg.append(std::to_string(audiogram::htonll(i)));
 
-            if (i != rd.max || li != mi->second.end())
+            if (i != rd.max || li != rexmits.end())
                 msg.append(",");
         }
     }
 
-    int uninitialized_recv(char *buffer, audiogram &a) {
+    int uninitialized_recv(char *buffer) {
         ssize_t rcv_len = read(mcast_rcv.sock, (void *)buffer, MAX_UDP_MSG_LEN);
-        if (rcv_len < 0) {
+        if (rcv_len < 0)
             return 1;
-        } else {
-            psize = (size_t) rcv_len;
-            audio_buf =
-                    std::vector<audiogram>(bsize / psize, audiogram(0, false));
-            a.set_size(psize);
-            a.set_session_id(*(uint64_t *)buffer);
-            a.set_packet_id(*(uint64_t *)(buffer + sizeof(uint64_t)));
-            memcpy(a.get_packet_data(), buffer, psize);
-            return 0;
-        }
+        return first_packet((uint8_t *)buffer, (size_t)rcv_len);
+    }
+
+    /* sets the buffer up for the first packet of a session,
+     * returns 1 if the packet cannot start one, 0 otherwise */
+    int first_packet(const uint8_t *packet, size_t len) {
+        if (len < (size_t)audiogram::HEADER_SIZE ||
+            fec::is_parity(audiogram::packet_id_of(packet)) ||
+            (audiogram::has_timestamp(packet) &&
+             len <= (size_t)(audiogram::HEADER_SIZE + audiogram::TIMESTAMP_SIZE)))
+            return 1;
+
+        psize = len;
+        audio_buf.init(psize, std::max(bsize / psize, (size_t)2), RECV_BATCH);
+        gap_found.assign(audio_buf.capacity(), 0);
+        rx_ns.assign(audio_buf.capacity(), 0);
+        handed_ns.assign(audio_buf.slots(), 0);
+        return 0;
     }
 };
\ No newline at end of file
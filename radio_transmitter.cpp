@@ -6,63 +6,136 @@
 #include <chrono>
 #include <thread>
 #include <atomic>
-#include <mutex>
-#include <memory>
 #include <limits>
-#include <queue>
 #include <set>
+#include <unordered_map>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include "boost/circular_buffer.hpp"
 #include "boost/program_options.hpp"
 #include "audiogram.h"
 #include "audio_transmitter.h"
+#include "packet_ring.h"
+#include "rexmit_msg.h"
+#include "spsc_ring.h"
+#include "input_stage.h"
+#include "stats.h"
+#include "logger.h"
 #include "receiver.h"
 #include "const.h"
 
 
 class radio_transmitter : protected audio_transmitter {
 private:
-    boost::circular_buffer<audiogram> data_q;
-    std::unique_ptr<std::set<uint64_t>> retransmit_nums_ptr;
-    std::queue<sockaddr_in> replies_q;
-    std::mutex retransmit_nums_mut;
-    std::mutex replies_mut;
-    std::atomic_flag keep_listening_lookups = ATOMIC_FLAG_INIT;
-    std::atomic_flag keep_listening_rexmits = ATOMIC_FLAG_INIT;
-    std::atomic_flag stop_replying = ATOMIC_FLAG_INIT;
+    static const size_t REXMIT_Q_LEN = 1 << 16; // requested ids awaiting resend
+    static const int MAX_EVENTS = 8;
+
+    /* retransmission statistics, kept by the sending thread */
+    struct rexmit_stats {
+        counter requested; // ids received, counting every receiver
+        counter coalesced; // requested again within the same round
+        counter suppressed; // resent recently enough already
+        counter evicted; // no longer in the history
+        counter resent;
+    };
+
+    /* sending statistics, kept by the sending thread */
+    struct send_stats {
+        counter fresh_packets; // sent for the first time
+        counter fresh_bytes;
+        counter rexmit_bytes; // packets are in rexmit_stats::resent
+        counter parity_packets;
+        counter stall_ns; // waiting for stdin with nothing else to do
+        gauge history; // packets in data_q
+    };
+
+    /* per second rates, kept by the control thread */
+    struct send_rates {
+        rate fresh_packets;
+        rate fresh_bytes;
+        rate rexmit_packets;
+        rate rexmit_bytes;
+        rate nack_ids;
+    };
+
+    packet_ring data_q;
+    /* when packets were last resent, in pacer::now() time, only those
+     * resent within holdoff */
+    std::unordered_map<uint64_t, uint64_t> resent_at;
+    rexmit_stats rexmit_st;
+    send_stats send_st;
+    send_rates rates;
+    counter nacks; // requests received, kept by the control thread
+    counter nack_ids; // ids in them
+    std::vector<uint8_t> parity_slab; // parity packets waiting for a flush
+    size_t parity_slots = 0;
+    size_t parity_slot = 0;
+    bool parity_open = false; // the block being xored started with us
+    input_stage input;
+    spsc_ring<uint64_t> rexmit_q; // control thread -> sending thread
+    /* ids of the oldest and the newest packet in data_q, published by the
+     * sending thread for the control thread, oldest > newest if empty */
+    std::atomic<uint64_t> oldest_held{1};
+    std::atomic<uint64_t> newest_held{0};
+    counter rexmit_q_drops; // kept by the control thread
     int rcv_sock = -1;
+    int epoll_fd = -1;
+    int stop_fd = -1; // eventfd ending the control thread
+    int stats_sock = -1; // listening on stats_port
+    int rates_fd = -1; // timerfd updating rates every second
 
 public:
     ~radio_transmitter() {
         close(rcv_sock);
+        close(epoll_fd);
+        close(stop_fd);
+        close(stats_sock);
+        close(rates_fd);
     }
 
     int init(int argc, char *argv[]) override {
-        data_q = boost::circular_buffer<audiogram>(fsize / psize);
-        retransmit_nums_ptr = std::make_unique<std::set<uint64_t>>();
-        audio_transmitter::init(argc, argv);
+        if (audio_transmitter::init(argc, argv))
+            return 1;
+        if (history_file.empty()) {
+            if (data_q.init(psize, fsize / psize, huge_pages, lock_history))
+                return 1;
+        } else if (data_q.init_file(history_file, psize, fsize / psize)) {
+            return 1;
+        }
+        rexmit_q.init(REXMIT_Q_LEN);
+        if (fec_block) {
+            // a slot is reused only after more than a whole batch is queued
+            parity_slots = batch / fec_block + 2;
+            parity_slab = std::vector<uint8_t>(parity_slots * psize);
+        }
+        if (input.start(STDIN_FILENO))
+            return 1;
         fcntl(replies_tr.sock, F_SETFL, O_NONBLOCK);
+        prepare_to_receive();
+
+        return prepare_control();
     }
 
     void work() {
-        keep_listening_lookups.test_and_set();
-        std::thread t1(&radio_transmitter::listen_for_incoming_lookups, this);
-        stop_replying.test_and_set();
-        std::thread t2(&radio_transmitter::send_replies, this);
-        keep_listening_rexmits.test_and_set();
-        std::thread t3(&radio_transmitter::listen_for_incoming_rexmits, this);
+        std::thread t(&radio_transmitter::control_loop, this);
 
         transmit_and_retransmit();
-        keep_listening_lookups.clear();
-        keep_listening_rexmits.clear();
-        stop_replying.clear();
-
-        t1.join();
-        t2.join();
-        t3.join();
+        uint64_t stop = 1;
+        if (write(stop_fd, &stop, sizeof(stop)) < 0)
+            LOG_ERROR("Error: stop write, errno = " << errno);
+        t.join();
+
+        sender.print_stats();
+        LOG_INFO("retransmission requests: " << rexmit_st.requested.get()
+                 << " ids, " << rexmit_st.coalesced.get() << " coalesced, "
+                 << rexmit_st.suppressed.get() << " suppressed, "
+                 << rexmit_st.evicted.get() << " evicted, "
+                 << rexmit_q_drops.get() << " dropped, "
+                 << rexmit_st.resent.get() << " resent");
     }
 
 private:
@@ -75,24 +148,17 @@ private:
             close(rcv_sock);
             rcv_sock = socket(AF_INET, SOCK_DGRAM, 0); // creating IPv4 UDP socket
             if (rcv_sock < 0) {
-                std::cerr << "Error: ctrl_rcv socket, errno = " << errno << "\n";
+                LOG_ERROR("Error: ctrl_rcv socket, errno = " << errno);
                 err = 1;
             }
 
             int optval = 1;
             if (setsockopt(rcv_sock, SOL_SOCKET, SO_BROADCAST, (void *) &optval,
                            sizeof optval) < 0) {
-                std::cerr << "Error: setsockopt broadcast\n";
-                err = 1;
-            }
-            struct timeval tv;
-            tv.tv_sec = 0;
-            tv.tv_usec = 300000;
-            if (setsockopt(rcv_sock, SOL_SOCKET, SO_RCVTIMEO, &tv,
-                           sizeof(tv)) < 0) {
-                std::cerr << "Error: setsockopt rcvtimeo\n";
+                LOG_ERROR("Error: setsockopt broadcast");
                 err = 1;
             }
+            fcntl(rcv_sock, F_SETFL, O_NONBLOCK);
 
             server_address.sin_family = AF_INET; // IPv4
             server_address.sin_addr.s_addr = htonl(INADDR_ANY); // listening on all interfaces
@@ -101,144 +167,376 @@ private:
             // bind the socket to a concrete address
             if (bind(rcv_sock, (struct sockaddr *) &server_address,
                      (socklen_t) sizeof(server_address)) < 0) {
-                std::cerr << "Error: ctrl_rcv bind, errno = " << errno << "\n";
+                LOG_ERROR("Error: ctrl_rcv bind, errno = " << errno);
                 err = 1;
             }
         } while (err);
     }
 
-    void transmit_and_retransmit() {
-        namespace ch = std::chrono;
-        uint64_t packet_id = 0, session_id = (uint64_t)time(nullptr);
+    /* returns 1 if the control plane reactor could not be set up, 0 otherwise */
+    int prepare_control() {
+        epoll_fd = epoll_create1(0);
+        stop_fd = eventfd(0, EFD_NONBLOCK);
+        if (epoll_fd < 0 || stop_fd < 0) {
+            LOG_ERROR("Error: epoll setup, errno = " << errno);
+            return 1;
+        }
 
-        std::cerr << "session " << session_id << " sent\n";
-        while (!std::cin.eof()) {
-            /* transmit */
-            auto start = std::chrono::system_clock::now();
-            do {
-                audiogram a(psize, 1);
-                a.set_size(psize);
-                a.set_session_id(audiogram::htonll(session_id));
-                a.set_packet_id(audiogram::htonll(packet_id));
-                std::cin.read((char *)a.get_audio_data(),
-                              psize - audiogram::HEADER_SIZE);
-                if (std::cin.fail())
-                    return;
+        if (stats_port != 0) {
+            stats_sock = stats_listen(stats_port);
+            rates_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+            struct itimerspec every = {};
+            every.it_value.tv_sec = 1;
+            every.it_interval.tv_sec = 1;
+            if (stats_sock < 0 || rates_fd < 0 ||
+                timerfd_settime(rates_fd, 0, &every, nullptr) < 0) {
+                LOG_ERROR("Error: stats setup, errno = " << errno);
+                return 1;
+            }
+        }
 
-                send_audiogram(a);
+        for (int fd : {rcv_sock, replies_tr.sock, stop_fd, stats_sock, rates_fd}) {
+            if (fd < 0)
+                continue;
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                LOG_ERROR("Error: epoll_ctl, errno = " << errno);
+                return 1;
+            }
+        }
 
-                data_q.push_back(std::move(a));
+        return 0;
+    }
+
+    void transmit_and_retransmit() {
+        const uint64_t rtime_ns = (uint64_t)rtime.count() * 1000 * 1000;
+        const size_t payload = audio_size();
+        uint64_t packet_id = 0, session_id = (uint64_t)time(nullptr);
+        uint64_t next_rexmit = pacer::now() + rtime_ns;
+
+        if (!data_q.empty() &&
+            audiogram::has_timestamp(data_q.back()) != timestamps) {
+            LOG_WARN("history sent with" << (timestamps ? "out" : "")
+                     << " timestamps is not resumed");
+            data_q.clear();
+        }
+        if (!data_q.empty()) { // history taken over from a previous run
+            session_id = audiogram::session_id_of(data_q.back());
+            packet_id = audiogram::packet_id_of(data_q.back()) + psize;
+            LOG_INFO("resuming after " << data_q.size() << " packets");
+            publish_held();
+        }
+        LOG_INFO("session " << session_id << " sent");
+        while (!input.finished(payload)) {
+            /* transmit whatever the input stage has ready */
+            while (input.available() >= payload && pacer::now() < next_rexmit) {
+                uint8_t *packet = data_q.push();
+                audiogram::write_header(packet, session_id, packet_id);
+                input.read_exact(packet + psize - payload, payload);
+
+                pace_packet(pacer::FRESH);
+                /* stamped once paced, not when sendmmsg goes out: with -B
+                 * the wait for the rest of the batch counts as network
+                 * latency, the stamp has to be in place before the packet
+                 * is xored into its parity and committed */
+                if (timestamps)
+                    audiogram::write_timestamp(packet, audiogram::wall_clock_ns());
+                data_q.commit(packet);
+                send_packet(packet);
+                publish_held();
+                send_st.fresh_packets.add();
+                send_st.fresh_bytes.add(psize);
+                if (fec_block)
+                    add_to_parity(packet, session_id, packet_id);
                 packet_id += psize;
-            } while (ch::system_clock::now() - start < rtime && !std::cin.eof());
-
-            /* retransmit */
-            retransmit_nums_mut.lock();
-            std::unique_ptr<std::set<uint64_t>> nums_ptr =
-                    std::move(retransmit_nums_ptr);
-            retransmit_nums_ptr = std::make_unique<std::set<uint64_t>>();
-            retransmit_nums_mut.unlock();
-
-            int q = 0;
-            for (uint64_t num : *nums_ptr) {
-                while (q < data_q.size() && num > data_q[q].get_packet_id())
-                    ++q;
-                if (q == data_q.size())
-                    break;
-
-                if (num == data_q[q].get_packet_id())
-                    send_audiogram(data_q[q]);
-
-                ++q;
             }
+            // do not hold a partial batch while waiting for input
+            flush_packets();
+
+            /* retransmit, independently of the input */
+            uint64_t now = pacer::now();
+            if (now >= next_rexmit) {
+                retransmit();
+                next_rexmit = now + rtime_ns;
+            } else if (input.available() < payload) {
+                input.wait((int)((next_rexmit - now) / (1000 * 1000)) + 1);
+                send_st.stall_ns.add(pacer::now() - now);
+            }
+            send_st.history.set(data_q.size());
         }
     }
 
-    void listen_for_incoming_lookups() {
-        prepare_to_receive();
-        char buffer[MAX_UDP_MSG_LEN];
+    /* xors the packet into the parity of its block, sends the parity
+     * after the last packet of the block; everything after the header is
+     * covered, so a rebuilt packet gets its timestamp back too */
+    void add_to_parity(const uint8_t *packet, uint64_t session_id,
+                       uint64_t packet_id) {
+        const size_t payload = psize - audiogram::HEADER_SIZE;
+        uint64_t idx_in_block = (packet_id / psize) % fec_block;
+        uint8_t *parity = &parity_slab[parity_slot * psize];
+
+        if (idx_in_block == 0) {
+            memcpy(parity + audiogram::HEADER_SIZE,
+                   packet + audiogram::HEADER_SIZE, payload);
+            parity_open = true;
+        } else {
+            fec::xor_into(parity + audiogram::HEADER_SIZE,
+                          packet + audiogram::HEADER_SIZE, payload);
+        }
 
-        while (keep_listening_lookups.test_and_set()) {
-            struct sockaddr_in rcv_addr;
-            socklen_t rcv_addr_len = (socklen_t)sizeof(rcv_addr);
-            ssize_t rcv_len = recvfrom(rcv_sock, (void *)&buffer, sizeof(buffer),
-                    0, (struct sockaddr *)&rcv_addr, &rcv_addr_len);
-
-            if (rcv_len >= 0) {
-                buffer[rcv_len] = '\0';
-
-                if (buffer[0] == LOOKUP_MSG[0]) {
-                    if (!parse_lookup(buffer, (size_t)rcv_len)) {
-                        replies_mut.lock();
-                        replies_q.push(rcv_addr);
-                        std::cerr << "reply pushed with "
-                                  << inet_ntoa(rcv_addr.sin_addr) << "\n";
-                        replies_mut.unlock();
-                    }
-                }
+        if (idx_in_block == fec_block - 1 && parity_open) {
+            uint64_t first_id = packet_id - (fec_block - 1) * psize;
+            audiogram::write_header(parity, session_id,
+                                    fec::parity_id(first_id, fec_block));
+            pace_packet(pacer::PARITY);
+            send_packet(parity);
+            send_st.parity_packets.add();
+            parity_slot = (parity_slot + 1) % parity_slots;
+            parity_open = false;
+        }
+    }
+
+    void publish_held() {
+        oldest_held = audiogram::packet_id_of(data_q[0]);
+        newest_held = audiogram::packet_id_of(data_q.back());
+    }
+
+    void retransmit() {
+        const uint64_t holdoff_ns = (uint64_t)holdoff.count() * 1000 * 1000;
+        std::set<uint64_t> nums;
+        uint64_t num;
+        while (rexmit_q.pop(num)) {
+            rexmit_st.requested.add();
+            if (!nums.insert(num).second)
+                rexmit_st.coalesced.add();
+        }
+
+        uint64_t now = pacer::now();
+        for (auto it = resent_at.begin(); it != resent_at.end();) {
+            if (now - it->second >= holdoff_ns)
+                it = resent_at.erase(it);
+            else
+                ++it;
+        }
+
+        for (uint64_t num : nums) {
+            uint8_t *packet = find_in_history(num);
+            if (packet == nullptr) {
+                rexmit_st.evicted.add();
+                continue;
+            }
+
+            auto mark = resent_at.find(num);
+            if (mark != resent_at.end()) { // within holdoff, pruned above
+                rexmit_st.suppressed.add();
+                continue;
             }
+            resent_at[num] = now;
+
+            pace_packet(pacer::REXMIT);
+            send_packet(packet);
+            rexmit_st.resent.add();
+            send_st.rexmit_bytes.add(psize);
         }
+        flush_packets();
     }
 
-    void listen_for_incoming_rexmits() {
-        char buffer[MAX_UDP_MSG_LEN];
+    /* returns the stored packet with the given id or nullptr if it is not
+     * in the history, ids of consecutive packets differ by psize */
+    uint8_t *find_in_history(uint64_t packet_id) {
+        if (data_q.empty())
+            return nullptr;
+
+        uint64_t oldest_id = audiogram::packet_id_of(data_q[0]);
+        if (packet_id < oldest_id || (packet_id - oldest_id) % psize != 0)
+            return nullptr;
 
-        while (keep_listening_rexmits.test_and_set()) {
+        uint64_t idx = (packet_id - oldest_id) / psize;
+        if (idx >= data_q.size())
+            return nullptr;
+
+        return data_q[idx];
+    }
+
+    /* single thread answering lookups, collecting retransmission requests
+     * and serving statistics, woken up only when one of its sockets is
+     * readable or the rates are due */
+    void control_loop() {
+        struct epoll_event events[MAX_EVENTS];
+        char buffer[MAX_UDP_MSG_LEN + 1];
+
+        while (true) {
+            int ev_num = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+            if (ev_num < 0) {
+                if (errno == EINTR)
+                    continue;
+                LOG_ERROR("Error: epoll_wait, errno = " << errno);
+                return;
+            }
+
+            for (int i = 0; i < ev_num; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == stop_fd)
+                    return;
+                if (fd == rcv_sock)
+                    handle_lookups(buffer);
+                else if (fd == replies_tr.sock)
+                    handle_rexmits(buffer);
+                else if (fd == rates_fd)
+                    update_rates();
+                else if (fd == stats_sock)
+                    stats_serve(stats_sock,
+                                [this](std::string &out) { stats_json(out); });
+            }
+        }
+    }
+
+    /* buffer has to hold MAX_UDP_MSG_LEN + 1 bytes */
+    void handle_lookups(char *buffer) {
+        while (true) {
             struct sockaddr_in rcv_addr;
             socklen_t rcv_addr_len = (socklen_t)sizeof(rcv_addr);
-            ssize_t rcv_len = recvfrom(replies_tr.sock, (void *)&buffer,
-                    sizeof(buffer), 0, (struct sockaddr *)&rcv_addr,
+            ssize_t rcv_len = recvfrom(rcv_sock, (void *)buffer,
+                    MAX_UDP_MSG_LEN, 0, (struct sockaddr *)&rcv_addr,
                     &rcv_addr_len);
+            if (rcv_len < 0)
+                return;
 
-            if (rcv_len >= 0) {
-                buffer[rcv_len] = '\0';
-
-                if (buffer[0] == REXMIT_MSG[0]) {
-                    std::vector<uint64_t> results;
-                    if (!parse_rexmit(buffer, (size_t)rcv_len, results)) {
-                        retransmit_nums_mut.lock();
-                        for(uint64_t res : results)
-                            retransmit_nums_ptr->insert(res);
-                        retransmit_nums_mut.unlock();
-                    }
-                }
-            }
+            buffer[rcv_len] = '\0';
+            if (buffer[0] == LOOKUP_MSG[0] &&
+                !parse_lookup(buffer, (size_t)rcv_len))
+                send_reply(rcv_addr);
         }
     }
 
-    void send_replies() {
-        while (stop_replying.test_and_set()) {
-            int not_empty = 0;
-            sockaddr_in addr;
-            replies_mut.lock();
-            if (!replies_q.empty()) {
-                addr = replies_q.back();
-                replies_q.pop();
-                not_empty = 1;
-            }
-            replies_mut.unlock();
+    /* buffer has to hold MAX_UDP_MSG_LEN + 1 bytes */
+    void handle_rexmits(char *buffer) {
+        std::vector<uint64_t> results;
 
-            if (not_empty) {
-                send_reply(addr);
-            }
+        while (true) {
+            struct sockaddr_in rcv_addr;
+            socklen_t rcv_addr_len = (socklen_t)sizeof(rcv_addr);
+            ssize_t rcv_len = recvfrom(replies_tr.sock, (void *)buffer,
+                    MAX_UDP_MSG_LEN, 0, (struct sockaddr *)&rcv_addr,
+                    &rcv_addr_len);
+            if (rcv_len < 0)
+                return;
+
+            buffer[rcv_len] = '\0';
+            if (buffer[0] != REXMIT_MSG[0])
+                continue;
+
+            results.clear();
+            int err = rexmit_msg::is_binary(buffer, (size_t)rcv_len) ?
+                    parse_bin_rexmit(buffer, (size_t)rcv_len, results) :
+                    parse_rexmit(buffer, (size_t)rcv_len, results);
+            if (err)
+                continue;
+
+            nacks.add();
+            nack_ids.add(results.size());
+            size_t pushed = rexmit_q.push(results.data(), results.size());
+            rexmit_q_drops.add(results.size() - pushed);
         }
     }
 
+    void update_rates() {
+        uint64_t val;
+        if (read(rates_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+            LOG_ERROR("Error: rates read, errno = " << errno);
+
+        uint64_t now = pacer::now();
+        rates.fresh_packets.tick(send_st.fresh_packets, now);
+        rates.fresh_bytes.tick(send_st.fresh_bytes, now);
+        rates.rexmit_packets.tick(rexmit_st.resent, now);
+        rates.rexmit_bytes.tick(send_st.rexmit_bytes, now);
+        rates.nack_ids.tick(nack_ids, now);
+    }
+
+    void stats_json(std::string &out) {
+        out.append("{");
+        json_field(out, "fresh_packets", send_st.fresh_packets.get(), true);
+        json_field(out, "fresh_bytes", send_st.fresh_bytes.get());
+        json_field(out, "fresh_packets_per_s", rates.fresh_packets.get());
+        json_field(out, "fresh_bytes_per_s", rates.fresh_bytes.get());
+        json_field(out, "rexmit_packets", rexmit_st.resent.get());
+        json_field(out, "rexmit_bytes", send_st.rexmit_bytes.get());
+        json_field(out, "rexmit_packets_per_s", rates.rexmit_packets.get());
+        json_field(out, "rexmit_bytes_per_s", rates.rexmit_bytes.get());
+        json_field(out, "parity_packets", send_st.parity_packets.get());
+        json_field(out, "nacks", nacks.get());
+        json_field(out, "nack_ids", nack_ids.get());
+        json_field(out, "nack_ids_per_s", rates.nack_ids.get());
+        json_field(out, "nack_ids_dropped", rexmit_q_drops.get());
+        json_field(out, "requested", rexmit_st.requested.get());
+        json_field(out, "coalesced", rexmit_st.coalesced.get());
+        json_field(out, "suppressed", rexmit_st.suppressed.get());
+        json_field(out, "history_hits", rexmit_st.resent.get() +
+                                        rexmit_st.suppressed.get());
+        json_field(out, "history_misses", rexmit_st.evicted.get());
+        json_field(out, "history_packets", send_st.history.get());
+        json_field(out, "history_capacity", data_q.capacity());
+        json_field(out, "send_syscalls", sender.syscalls.get());
+        json_field(out, "send_errors", sender.errors.get());
+        json_field(out, "stdin_stall_ms", send_st.stall_ns.get() / 1000000);
+        out.append("}");
+    }
+
     int parse_lookup(const char *msg, size_t len) {
         if (strstr(msg, LOOKUP_MSG) != msg)
             return 1;
         return len != strlen(LOOKUP_MSG);
     }
 
+    /* Only packets still in the history can be resent and only as many as
+     * fit into rexmit_q, so a forged request of either kind cannot make more
+     * of it. Sets the ids held and the room left in rexmit_q. */
+    void rexmit_bounds(uint64_t &oldest, uint64_t &newest, size_t &room) {
+        oldest = oldest_held.load();
+        newest = newest_held.load();
+        room = rexmit_q.capacity() - rexmit_q.size();
+    }
+
+    int parse_bin_rexmit(const char *msg, const size_t len,
+                         std::vector<uint64_t> &results) {
+        std::vector<rexmit_msg::range> ranges;
+        if (rexmit_msg::decode((const uint8_t *)msg, len, psize, ranges))
+            return 1;
+
+        uint64_t oldest, newest;
+        size_t room;
+        rexmit_bounds(oldest, newest, room);
+        for (rexmit_msg::range &r : ranges) {
+            if (results.size() >= room)
+                break;
+            if (r.first > newest)
+                continue;
+            uint64_t first = r.first;
+            if (first < oldest)
+                first += (oldest - first + psize - 1) / psize * psize;
+            uint64_t past_last = r.first + r.count * psize;
+            for (uint64_t id = first; id < past_last && id <= newest &&
+                                      results.size() < room; id += psize)
+                results.push_back(id);
+        }
+
+        return 0;
+    }
+
     int parse_rexmit(char *msg, const size_t len, std::vector<uint64_t> &results) {
         if (strstr(msg, REXMIT_MSG) != msg || msg[len] == ',')
             return 1;
 
-        uint64_t res = 0;
+        uint64_t res = 0, oldest, newest;
+        size_t room;
         int err = 0;
+        rexmit_bounds(oldest, newest, room);
         strtok(msg, " ");
         char *token = strtok(nullptr, ",");
 
-        while (token != nullptr) {
+        while (token != nullptr && results.size() < room) {
             std::string tok(token);
 
             if (tok[0] == '-')
@@ -250,7 +548,7 @@ private:
                 err = 1;
             }
 
-            if (!err)
+            if (!err && res >= oldest && res <= newest)
                 results.push_back(res);
             token = strtok(nullptr, ",");
         }
@@ -1,11 +1,11 @@
 #ifndef RADIO_RECEIVER_H
 #define RADIO_RECEIVER_H
 
-#include <iostream>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "logger.h"
 
 class receiver {
 public:
@@ -24,14 +24,14 @@ public:
             close(sock);
             sock = socket(AF_INET, SOCK_DGRAM, 0); // creating IPv4 UDP socket
             if (sock < 0) {
-                std::cerr << "Error: rcv socket, errno = " << errno << "\n";
+                LOG_ERROR("Error: rcv socket, errno = " << errno);
                 err = 1;
             }
 
             int optval = 1;
             if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (void *) &optval,
                            sizeof optval) < 0) {
-                std::cerr << "Error: setsockopt broadcast\n";
+                LOG_ERROR("Error: setsockopt broadcast");
                 err = 1;
             }
 
@@ -42,7 +42,7 @@ public:
             // bind the socket to a concrete address
             if (bind(sock, (struct sockaddr *) &server_address,
                      (socklen_t) sizeof(server_address)) < 0) {
-                std::cerr << "Error: rcv bind, errno = " << errno << "\n";
+                LOG_ERROR("Error: rcv bind, errno = " << errno);
                 err = 1;
             }
         } while (err);
@@ -57,7 +57,7 @@ public:
         /* otworzenie gniazda */
         sock = socket(AF_INET, SOCK_DGRAM, 0);
         if (sock < 0) {
-            std::cerr << "Error: socket\n";
+            LOG_ERROR("Error: socket");
             err = 1;
         }
 
@@ -66,17 +66,37 @@ public:
         ip_mreq.imr_multiaddr = addr.sin_addr;
         if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void*)&ip_mreq,
                        sizeof(ip_mreq)) < 0) {
-            std::cerr << "Error: mcast rcv setsockopt\n";
+            LOG_ERROR("Error: mcast rcv setsockopt");
             err = 1;
         }
 
+        /* stations kept on standby may share the port, each socket gets
+         * datagrams of its own group only */
+        int optval = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*)&optval,
+                       sizeof(optval)) < 0) {
+            LOG_ERROR("Error: mcast rcv setsockopt reuseaddr");
+            err = 1;
+        }
+        optval = 0;
+        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, (void*)&optval,
+                       sizeof(optval)) < 0) {
+            LOG_ERROR("Error: mcast rcv setsockopt all");
+            err = 1;
+        }
+        /* kernel receive times, for the latency of timestamped streams */
+        optval = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, (void*)&optval,
+                       sizeof(optval)) < 0)
+            LOG_WARN("no kernel receive times, errno = " << errno);
+
         /* podpięcie się pod lokalny adres i port */
             local_address.sin_family = AF_INET;
             local_address.sin_addr.s_addr = htonl(INADDR_ANY);
             local_address.sin_port = addr.sin_port;
             if (bind(sock, (struct sockaddr *) &local_address,
                     sizeof(local_address)) < 0) {
-                std::cerr << "Error: bind, errno = " << errno << "\n";
+                LOG_ERROR("Error: bind, errno = " << errno);
                 err = 1;
             }
 
@@ -0,0 +1,92 @@
+#ifndef RADIO_REORDER_BUF_H
+#define RADIO_REORDER_BUF_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <utility>
+
+/* Receiver side window of equally sized packets kept in one contiguous slab.
+ * Packets are numbered from the start of the session, packet n is kept at
+ * position n % capacity. Besides the positions there are spare slots which
+ * packets are received into; a valid packet is published by swapping its
+ * slot with the one at its position, so it is never copied. */
+class reorder_buf {
+private:
+    std::vector<uint8_t> slab;
+    size_t stride = 0;
+    size_t cap = 0;
+    std::vector<uint32_t> slot; // position -> slab slot
+    std::vector<uint8_t> fresh; // per position, not handed out yet
+    std::vector<uint32_t> spare; // slab slots outside of the window
+
+public:
+    uint8_t *slot_data(uint32_t s) {
+        return slab.data() + (size_t)s * stride;
+    }
+
+    void init(size_t psize, size_t capacity, size_t spares) {
+        stride = psize;
+        cap = capacity;
+        slab = std::vector<uint8_t>(stride * (cap + spares));
+        slot = std::vector<uint32_t>(cap);
+        fresh = std::vector<uint8_t>(cap);
+        spare = std::vector<uint32_t>(spares);
+        for (size_t i = 0; i < cap; ++i)
+            slot[i] = (uint32_t)i;
+        for (size_t i = 0; i < spares; ++i)
+            spare[i] = (uint32_t)(cap + i);
+    }
+
+    size_t capacity() {
+        return cap;
+    }
+
+    size_t spares() {
+        return spare.size();
+    }
+
+    /* slab slots, positions and spare ones together */
+    size_t slots() {
+        return cap + spare.size();
+    }
+
+    /* packet kept at the position of packet n */
+    uint8_t *at(uint64_t n) {
+        return slot_data(slot[n % cap]);
+    }
+
+    /* slab slot holding packet n, stays the same until n is published
+     * over or the buffer is initialised again */
+    uint32_t slot_of(uint64_t n) {
+        return slot[n % cap];
+    }
+
+    bool is_fresh(uint64_t n) {
+        return fresh[n % cap] != 0;
+    }
+
+    void set_fresh(uint64_t n, bool f) {
+        fresh[n % cap] = f;
+    }
+
+    uint8_t *spare_at(size_t i) {
+        return slot_data(spare[i]);
+    }
+
+    /* makes the i-th spare slot packet n, the slot it replaces becomes
+     * the i-th spare one */
+    void publish(size_t i, uint64_t n) {
+        std::swap(slot[n % cap], spare[i]);
+        fresh[n % cap] = 1;
+    }
+
+    /* copies a packet built elsewhere in as packet n */
+    void store(const uint8_t *packet, uint64_t n) {
+        memcpy(at(n), packet, stride);
+        fresh[n % cap] = 1;
+    }
+};
+
+
+#endif //RADIO_REORDER_BUF_H
@@ -0,0 +1,184 @@
+#ifndef RADIO_REXMIT_MSG_H
+#define RADIO_REXMIT_MSG_H
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <arpa/inet.h>
+#include "audiogram.h"
+#include "const.h"
+
+/* Binary retransmission request, an alternative to the textual REXMIT_MSG
+ * for transmitters advertising REXMIT_BIN_CAP in their replies.
+ *
+ * REXMIT_BIN_MSG | kind (1) | base id (8) | psize (4) | count (2) | body
+ *
+ * With kind RANGES the body is count pairs of (first, length) (4 + 4),
+ * with kind BITMAP it is count bytes whose bit i % 8 of byte i / 8 marks
+ * packet base + i * psize as missing. Integers are in network byte order,
+ * first is counted in packets from base. */
+class rexmit_msg {
+public:
+    struct range {
+        uint64_t first; // packet id
+        uint64_t count; // number of consecutive packets
+    };
+
+    static const uint8_t RANGES = 'R';
+    static const uint8_t BITMAP = 'B';
+    static const size_t PREFIX_LEN = sizeof(REXMIT_BIN_MSG) - 1;
+    static const size_t HEADER_LEN = PREFIX_LEN + 1 + 8 + 4 + 2;
+    static const size_t RANGE_LEN = 8;
+
+    static bool is_binary(const char *msg, size_t len) {
+        return len >= PREFIX_LEN && memcmp(msg, REXMIT_BIN_MSG, PREFIX_LEN) == 0;
+    }
+
+    /* splits ranges longer than a single entry can express into
+     * consecutive ones, encode requires it */
+    static void split_long(std::vector<range> &ranges, size_t psize) {
+        std::vector<range> split;
+        for (const range &r : ranges) {
+            uint64_t first = r.first, count = r.count;
+            while (count > UINT32_MAX) {
+                split.push_back({first, UINT32_MAX});
+                first += (uint64_t)UINT32_MAX * psize;
+                count -= UINT32_MAX;
+            }
+            split.push_back({first, count});
+        }
+        ranges.swap(split);
+    }
+
+    /* Encodes ranges[from..] (sorted, disjoint, ids in host order, none
+     * longer than UINT32_MAX packets) into a single message of at most
+     * max_len bytes. Returns the index of the
+     * first range left for the next message, len is set to the message size. */
+    static size_t encode(const std::vector<range> &ranges, size_t from,
+                         size_t psize, uint8_t *msg, size_t max_len,
+                         size_t &len) {
+        size_t body_max = max_len - HEADER_LEN;
+        uint64_t base = ranges[from].first;
+
+        /* as many ranges as fit explicitly */
+        size_t r_end = from;
+        while (r_end < ranges.size() &&
+               (r_end - from + 1) * RANGE_LEN <= body_max &&
+               (ranges[r_end].first - base) / psize + ranges[r_end].count <=
+               UINT32_MAX)
+            ++r_end;
+
+        /* as many ranges as fit into a bitmap */
+        size_t bits_max = std::min(body_max, (size_t)UINT16_MAX) * 8;
+        size_t b_end = from;
+        uint64_t bits = 0;
+        while (b_end < ranges.size() &&
+               (ranges[b_end].first - base) / psize + ranges[b_end].count <=
+               bits_max) {
+            bits = (ranges[b_end].first - base) / psize + ranges[b_end].count;
+            ++b_end;
+        }
+
+        size_t body_len;
+        if (b_end >= r_end && b_end > from &&
+            (bits + 7) / 8 <= (r_end - from) * RANGE_LEN) {
+            body_len = (size_t)(bits + 7) / 8;
+            write_header(msg, BITMAP, base, psize, (uint16_t)body_len);
+            uint8_t *body = msg + HEADER_LEN;
+            memset(body, 0, body_len);
+            for (size_t i = from; i < b_end; ++i) {
+                uint64_t off = (ranges[i].first - base) / psize;
+                for (uint64_t b = off; b < off + ranges[i].count; ++b)
+                    body[b / 8] |= (uint8_t)(1u << (b % 8));
+            }
+            len = HEADER_LEN + body_len;
+            return b_end;
+        }
+
+        write_header(msg, RANGES, base, psize, (uint16_t)(r_end - from));
+        for (size_t i = from; i < r_end; ++i)
+            write_range(msg + HEADER_LEN + (i - from) * RANGE_LEN,
+                        (uint32_t)((ranges[i].first - base) / psize),
+                        (uint32_t)ranges[i].count);
+        len = HEADER_LEN + (r_end - from) * RANGE_LEN;
+        return r_end;
+    }
+
+    /* returns 1 if the message is malformed or its psize is not the expected
+     * one, 0 otherwise; decoded ranges are appended to results */
+    static int decode(const uint8_t *msg, size_t len, size_t psize,
+                      std::vector<range> &results) {
+        if (len < HEADER_LEN || !is_binary((const char *)msg, len))
+            return 1;
+
+        uint8_t kind = msg[PREFIX_LEN];
+        uint64_t base;
+        uint32_t msg_psize;
+        uint16_t count;
+        memcpy(&base, msg + PREFIX_LEN + 1, sizeof(base));
+        memcpy(&msg_psize, msg + PREFIX_LEN + 9, sizeof(msg_psize));
+        memcpy(&count, msg + PREFIX_LEN + 13, sizeof(count));
+        base = audiogram::ntohll(base);
+        count = ntohs(count);
+        if (ntohl(msg_psize) != psize)
+            return 1;
+
+        const uint8_t *body = msg + HEADER_LEN;
+        if (kind == RANGES) {
+            if (len != HEADER_LEN + count * RANGE_LEN)
+                return 1;
+            for (size_t i = 0; i < count; ++i) {
+                uint32_t first, length;
+                memcpy(&first, body + i * RANGE_LEN, sizeof(first));
+                memcpy(&length, body + i * RANGE_LEN + 4, sizeof(length));
+                if (length != 0)
+                    results.push_back({base + (uint64_t)ntohl(first) * psize,
+                                       ntohl(length)});
+            }
+        } else if (kind == BITMAP) {
+            if (len != HEADER_LEN + count)
+                return 1;
+            for (uint64_t b = 0; b < (uint64_t)count * 8; ++b) {
+                if (body[b / 8] == 0) {
+                    b |= 7;
+                    continue;
+                }
+                if (!(body[b / 8] & (1u << (b % 8))))
+                    continue;
+                uint64_t first = b;
+                while (b + 1 < (uint64_t)count * 8 &&
+                       (body[(b + 1) / 8] & (1u << ((b + 1) % 8))))
+                    ++b;
+                results.push_back({base + first * psize, b - first + 1});
+            }
+        } else {
+            return 1;
+        }
+
+        return 0;
+    }
+
+private:
+    static void write_header(uint8_t *msg, uint8_t kind, uint64_t base,
+                             size_t psize, uint16_t count) {
+        memcpy(msg, REXMIT_BIN_MSG, PREFIX_LEN);
+        msg[PREFIX_LEN] = kind;
+        base = audiogram::htonll(base);
+        uint32_t net_psize = htonl((uint32_t)psize);
+        count = htons(count);
+        memcpy(msg + PREFIX_LEN + 1, &base, sizeof(base));
+        memcpy(msg + PREFIX_LEN + 9, &net_psize, sizeof(net_psize));
+        memcpy(msg + PREFIX_LEN + 13, &count, sizeof(count));
+    }
+
+    static void write_range(uint8_t *at, uint32_t first, uint32_t length) {
+        first = htonl(first);
+        length = htonl(length);
+        memcpy(at, &first, sizeof(first));
+        memcpy(at + 4, &length, sizeof(length));
+    }
+};
+
+
+#endif //RADIO_REXMIT_MSG_H
@@ -1,7 +1,7 @@
 filename = "Cage The Elephant - Aint No Rest For The Wicked.mp3"
 
-sox -S $filename -r 44100 -b 16 -e signed-integer -c 2 -t raw - | pv -q -L $((44100*4)) | \
-./sender $(\
+sox -S $filename -r 44100 -b 16 -e signed-integer -c 2 -t raw - | \
+./sender -R $((44100*4*8)) $(\
 if [ $# -eq 0 ] ; then
     echo "-a 224.0.0.1"
 else
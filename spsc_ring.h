@@ -0,0 +1,90 @@
+#ifndef RADIO_SPSC_RING_H
+#define RADIO_SPSC_RING_H
+
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+/* Lock-free queue for exactly one producer thread and one consumer thread.
+ * The capacity is rounded up to a power of two. */
+template <typename T>
+class spsc_ring {
+private:
+    static const size_t CACHE_LINE = 64;
+
+    std::vector<T> buf;
+    size_t mask = 0;
+    alignas(CACHE_LINE) std::atomic<size_t> head{0}; // next to pop
+    alignas(CACHE_LINE) std::atomic<size_t> tail{0}; // next to push
+
+public:
+    void init(size_t capacity) {
+        size_t cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+        buf = std::vector<T>(cap);
+        mask = cap - 1;
+        head = 0;
+        tail = 0;
+    }
+
+    size_t capacity() {
+        return buf.size();
+    }
+
+    /* consumer and producer side, exact only on the consumer side */
+    size_t size() {
+        return tail.load(std::memory_order_acquire) -
+               head.load(std::memory_order_acquire);
+    }
+
+    bool empty() {
+        return size() == 0;
+    }
+
+    /* producer side, returns false if the ring is full */
+    bool push(const T &v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == buf.size())
+            return false;
+        buf[t & mask] = v;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* producer side, returns the number of elements pushed */
+    size_t push(const T *v, size_t n) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        n = std::min(n, buf.size() - (t - head.load(std::memory_order_acquire)));
+        size_t first = std::min(n, buf.size() - (t & mask));
+        std::copy(v, v + first, buf.begin() + (t & mask));
+        std::copy(v + first, v + n, buf.begin());
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    /* consumer side, returns false if the ring is empty */
+    bool pop(T &v) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        v = buf[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* consumer side, returns the number of elements popped */
+    size_t pop(T *v, size_t n) {
+        size_t h = head.load(std::memory_order_relaxed);
+        n = std::min(n, tail.load(std::memory_order_acquire) - h);
+        size_t first = std::min(n, buf.size() - (h & mask));
+        std::copy(buf.begin() + (h & mask), buf.begin() + (h & mask) + first, v);
+        std::copy(buf.begin(), buf.begin() + (n - first), v + first);
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+};
+
+
+#endif //RADIO_SPSC_RING_H
@@ -0,0 +1,145 @@
+#ifndef RADIO_STANDBY_H
+#define RADIO_STANDBY_H
+
+#include <cstdint>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "receiver.h"
+#include "const.h"
+
+/* A station which is not being played but is kept joined, so that switching
+ * to it can start playing from packets already received. Only the newest
+ * packets fitting in bsize bytes are kept. */
+class standby_station {
+private:
+    std::vector<uint8_t> slab;
+    std::vector<uint64_t> arrived; // per slot, when the packet was received
+    size_t bsize = 0;
+    size_t psize = 0; // 0 before the first packet
+    size_t cap = 0;
+    size_t head = 0; // slot of the oldest packet
+    size_t count = 0;
+
+    /* returns the slot for a new newest packet */
+    size_t push() {
+        size_t slot;
+        if (count == cap) {
+            slot = head;
+            head = (head + 1) % cap;
+        } else {
+            slot = (head + count) % cap;
+            ++count;
+        }
+        return slot;
+    }
+
+    void first_packet(uint64_t at) {
+        uint8_t buffer[MAX_UDP_MSG_LEN];
+        ssize_t len = recv(rcv.sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (len <= 0)
+            return;
+
+        psize = (size_t)len;
+        cap = std::max(bsize / psize, (size_t)2);
+        slab = std::vector<uint8_t>(psize * cap);
+        arrived = std::vector<uint64_t>(cap);
+        size_t slot = push();
+        std::copy(buffer, buffer + psize, slab.begin() + slot * psize);
+        arrived[slot] = at;
+    }
+
+public:
+    receiver rcv;
+    struct sockaddr_in addr = {};
+
+    standby_station() = default;
+    standby_station(const standby_station &) = delete;
+    standby_station &operator=(const standby_station &) = delete;
+
+    bool active() {
+        return rcv.sock >= 0;
+    }
+
+    /* returns 1 if the station could not be joined, 0 otherwise */
+    int join(const sockaddr_in &station, size_t buf_size) {
+        leave();
+        addr = station;
+        bsize = buf_size;
+        if (rcv.prepare_to_receive_mcast(station)) {
+            leave();
+            return 1;
+        }
+        return 0;
+    }
+
+    void leave() {
+        if (rcv.sock >= 0)
+            rcv.drop_mcast();
+        rcv.sock = -1;
+        clear();
+    }
+
+    /* forgets the packets, the socket stays joined */
+    void clear() {
+        psize = 0;
+        head = 0;
+        count = 0;
+    }
+
+    /* drains at most max_num packets received at time at from the socket */
+    void receive(uint64_t at, int max_num) {
+        for (int i = 0; i < max_num; ++i) {
+            if (psize == 0) {
+                first_packet(at);
+                if (psize == 0)
+                    return;
+                continue;
+            }
+
+            size_t slot = count == cap ? head : (head + count) % cap;
+            ssize_t len = recv(rcv.sock, slab.data() + slot * psize, psize,
+                               MSG_DONTWAIT | MSG_TRUNC);
+            if (len < 0)
+                return;
+            if ((size_t)len != psize) {
+                if (count == cap) { // the oldest packet got overwritten
+                    head = (head + 1) % cap;
+                    --count;
+                }
+                continue;
+            }
+            arrived[push()] = at;
+        }
+    }
+
+    size_t size() {
+        return count;
+    }
+
+    size_t packet_size() {
+        return psize;
+    }
+
+    /* i-th packet counting from the oldest one */
+    const uint8_t *packet(size_t i) {
+        return slab.data() + ((head + i) % cap) * psize;
+    }
+
+    uint64_t arrival(size_t i) {
+        return arrived[(head + i) % cap];
+    }
+
+    /* index of the oldest packet received at or after since */
+    size_t first_since(uint64_t since) {
+        size_t i = 0;
+        while (i < count && arrival(i) < since)
+            ++i;
+        return i;
+    }
+};
+
+
+#endif //RADIO_STANDBY_H
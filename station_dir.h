@@ -0,0 +1,164 @@
+#ifndef RADIO_STATION_DIR_H
+#define RADIO_STATION_DIR_H
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+
+struct station_det {
+    struct sockaddr_in addr;
+    struct sockaddr_in direct;
+    std::string name;
+    time_t last_answ; // when the station was added to the snapshot
+    bool bin_rexmit; // understands REXMIT_BIN_MSG
+};
+
+/* Directory of the stations which answered lookups. Readers take the current
+ * snapshot, which is never modified, so they do not wait for anybody and may
+ * keep it as long as they like. Writers are serialised, they publish a new
+ * snapshot only when stations come, go or change their details; a station
+ * answering again only has its time updated in a hash index by address. */
+class station_dir {
+public:
+    typedef std::map<std::string, std::list<station_det>> station_map;
+
+private:
+    struct seen {
+        std::string name;
+        struct sockaddr_in addr;
+        time_t last_answ;
+    };
+
+    std::shared_ptr<const station_map> current =
+            std::make_shared<const station_map>();
+    std::mutex write_mut;
+    std::unordered_map<uint64_t, seen> by_addr; // guarded by write_mut
+
+    static uint64_t key(const sockaddr_in &addr) {
+        return ((uint64_t)addr.sin_addr.s_addr << 16u) | addr.sin_port;
+    }
+
+    static bool same_addr(const sockaddr_in &a, const sockaddr_in &b) {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    /* returns true and the removed station in removed if it was there */
+    static bool remove(station_map &stations, const std::string &name,
+                       const sockaddr_in &addr, station_det &removed) {
+        auto mi = stations.find(name);
+        if (mi == stations.end())
+            return false;
+        for (auto li = mi->second.begin(); li != mi->second.end(); ++li) {
+            if (same_addr(li->addr, addr)) {
+                removed = *li;
+                mi->second.erase(li);
+                if (mi->second.empty())
+                    stations.erase(mi);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void publish(std::shared_ptr<const station_map> stations) {
+        std::atomic_store(&current, stations);
+    }
+
+public:
+    std::shared_ptr<const station_map> get() {
+        return std::atomic_load(&current);
+    }
+
+    /* Records an answer of a station. One silent for longer than timeout is
+     * dropped instead and returned in del_station.
+     * returns 1 if the station list changes, 0 otherwise */
+    int update(const sockaddr_in &addr, const sockaddr_in &direct,
+               const std::string &name, bool bin_rexmit, time_t now,
+               time_t timeout, station_det *del_station) {
+        std::lock_guard<std::mutex> lock(write_mut);
+        auto old = get();
+        auto si = by_addr.find(key(addr));
+
+        if (si != by_addr.end() && si->second.name == name) {
+            if (now - si->second.last_answ > timeout) {
+                auto stations = std::make_shared<station_map>(*old);
+                remove(*stations, name, addr, *del_station);
+                by_addr.erase(si);
+                publish(stations);
+                return 1;
+            }
+
+            si->second.last_answ = now;
+            for (auto &sd : old->at(name)) {
+                if (same_addr(sd.addr, addr) &&
+                    (!same_addr(sd.direct, direct) || sd.bin_rexmit != bin_rexmit)) {
+                    auto stations = std::make_shared<station_map>(*old);
+                    for (auto &changed : (*stations)[name]) {
+                        if (same_addr(changed.addr, addr)) {
+                            changed.direct = direct;
+                            changed.bin_rexmit = bin_rexmit;
+                        }
+                    }
+                    publish(stations);
+                    break;
+                }
+            }
+            return 0;
+        }
+
+        auto stations = std::make_shared<station_map>(*old);
+        if (si != by_addr.end()) { // renamed
+            station_det renamed;
+            remove(*stations, si->second.name, addr, renamed);
+        }
+        (*stations)[name].push_back({addr, direct, name, now, bin_rexmit});
+        by_addr[key(addr)] = {name, addr, now};
+        publish(stations);
+        return 1;
+    }
+
+    /* when the next station may have been silent for longer than timeout,
+     * 0 if there are none */
+    time_t next_expiry(time_t timeout) {
+        std::lock_guard<std::mutex> lock(write_mut);
+        time_t next = 0;
+        for (auto &si : by_addr)
+            if (next == 0 || si.second.last_answ + timeout + 1 < next)
+                next = si.second.last_answ + timeout + 1;
+        return next;
+    }
+
+    /* drops the stations silent for longer than timeout and returns them */
+    std::vector<station_det> expire(time_t now, time_t timeout) {
+        std::lock_guard<std::mutex> lock(write_mut);
+        std::vector<station_det> deleted;
+        std::shared_ptr<station_map> stations;
+
+        for (auto si = by_addr.begin(); si != by_addr.end();) {
+            if (now - si->second.last_answ <= timeout) {
+                ++si;
+                continue;
+            }
+            if (!stations)
+                stations = std::make_shared<station_map>(*get());
+            station_det removed;
+            if (remove(*stations, si->second.name, si->second.addr, removed))
+                deleted.push_back(removed);
+            si = by_addr.erase(si);
+        }
+
+        if (stations)
+            publish(stations);
+        return deleted;
+    }
+};
+
+
+#endif //RADIO_STATION_DIR_H
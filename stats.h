@@ -0,0 +1,231 @@
+#ifndef RADIO_STATS_H
+#define RADIO_STATS_H
+
+#include <cstdint>
+#include <cerrno>
+#include <cstdio>
+#include <atomic>
+#include <string>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "logger.h"
+
+/* Statistics kept on hot paths. Every counter and histogram has a single
+ * writer thread, so updating one is a relaxed load and store, no locked
+ * instruction; any thread may read them at any time. */
+class counter {
+private:
+    std::atomic<uint64_t> v{0};
+
+public:
+    void add(uint64_t n = 1) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return v.load(std::memory_order_relaxed);
+    }
+};
+
+/* current value of something, set by a single writer thread */
+class gauge {
+private:
+    std::atomic<uint64_t> v{0};
+
+public:
+    void set(uint64_t value) {
+        v.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return v.load(std::memory_order_relaxed);
+    }
+};
+
+/* per second rate of a counter over the time between the last two ticks,
+ * used by one thread */
+class rate {
+private:
+    uint64_t last = 0;
+    uint64_t last_at = 0;
+    uint64_t per_s = 0;
+
+public:
+    void tick(const counter &c, uint64_t now_ns) {
+        uint64_t value = c.get();
+        if (last_at != 0 && now_ns > last_at)
+            per_s = (value - last) * 1000000000 / (now_ns - last_at);
+        last = value;
+        last_at = now_ns;
+    }
+
+    uint64_t get() const {
+        return per_s;
+    }
+};
+
+/* Distribution of values in power of two buckets, bucket i counts values
+ * in [2^(i-1), 2^i), bucket 0 counts zeros. */
+class histogram {
+private:
+    static const int BUCKETS = 64;
+
+    counter buckets[BUCKETS];
+    counter num;
+    counter sum;
+    std::atomic<uint64_t> top{0};
+
+    static int bucket_of(uint64_t value) {
+        int b = 0;
+        while (value != 0 && b < BUCKETS - 1) {
+            value >>= 1;
+            ++b;
+        }
+        return b;
+    }
+
+public:
+    void record(uint64_t value) {
+        buckets[bucket_of(value)].add();
+        num.add();
+        sum.add(value);
+        if (value > top.load(std::memory_order_relaxed))
+            top.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return num.get();
+    }
+
+    uint64_t mean() const {
+        uint64_t n = num.get();
+        return n == 0 ? 0 : sum.get() / n;
+    }
+
+    uint64_t max() const {
+        return top.load(std::memory_order_relaxed);
+    }
+
+    /* upper bound of the bucket holding the given fraction of values */
+    uint64_t percentile(double fraction) const {
+        uint64_t n = num.get(), seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b].get();
+            if (n != 0 && seen >= fraction * n)
+                return b == 0 ? 0 : (uint64_t)1 << b;
+        }
+        return max();
+    }
+
+    /* {"count":..,"mean":..,"max":..,"buckets":[[upper bound, count],..]}
+     * listing the nonempty buckets only */
+    void json(std::string &out) const {
+        out.append("{\"count\":").append(std::to_string(count()))
+           .append(",\"mean\":").append(std::to_string(mean()))
+           .append(",\"max\":").append(std::to_string(max()))
+           .append(",\"buckets\":[");
+        bool first = true;
+        for (int b = 0; b < BUCKETS; ++b) {
+            uint64_t c = buckets[b].get();
+            if (c == 0)
+                continue;
+            if (!first)
+                out.append(",");
+            first = false;
+            out.append("[").append(std::to_string(b == 0 ? 0 : (uint64_t)1 << b))
+               .append(",").append(std::to_string(c)).append("]");
+        }
+        out.append("]}");
+    }
+};
+
+/* appends "name":value, with a comma unless it is the first field */
+inline void json_field(std::string &out, const char *name, uint64_t value,
+                       bool first = false) {
+    if (!first)
+        out.append(",");
+    out.append("\"").append(name).append("\":").append(std::to_string(value));
+}
+
+inline void json_field(std::string &out, const char *name, const histogram &h,
+                       bool first = false) {
+    if (!first)
+        out.append(",");
+    out.append("\"").append(name).append("\":");
+    h.json(out);
+}
+
+/* appends a string with quotes and the characters JSON requires escaped */
+inline void json_string(std::string &out, const std::string &s) {
+    out.append("\"");
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out.append("\\").append(1, c);
+        } else if ((unsigned char)c < 0x20) {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", (unsigned)c);
+            out.append(buffer);
+        } else {
+            out.append(1, c);
+        }
+    }
+    out.append("\"");
+}
+
+/* returns a nonblocking tcp socket listening on the loopback interface only,
+ * -1 if it cannot be set up */
+inline int stats_listen(in_port_t port) {
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    local.sin_port = htons(port);
+    int optval = 1;
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&optval,
+                   sizeof(optval)) < 0 ||
+        bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        listen(sock, 16) < 0) {
+        LOG_ERROR("Error: stats socket, errno = " << errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* sends every client waiting on the stats socket one line made by
+ * the given function and closes the connection; a client not taking
+ * the line within STATS_SEND_TIMEOUT_MS gets it cut off */
+static const int STATS_SEND_TIMEOUT_MS = 100;
+
+template <typename F>
+void stats_serve(int sock, F make_line) {
+    int client;
+    while ((client = accept4(sock, nullptr, nullptr, 0)) >= 0) {
+        struct timeval timeout = {0, STATS_SEND_TIMEOUT_MS * 1000};
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (void *)&timeout,
+                   sizeof(timeout));
+        std::string msg;
+        make_line(msg);
+        msg.append("\n");
+        size_t sent = 0;
+        while (sent < msg.size()) {
+            ssize_t ret = send(client, msg.data() + sent, msg.size() - sent,
+                               MSG_NOSIGNAL);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                LOG_ERROR("Error: stats send, errno = " << errno);
+                break;
+            }
+            sent += (size_t)ret;
+        }
+        close(client);
+    }
+}
+
+
+#endif //RADIO_STATS_H
@@ -0,0 +1,104 @@
+#ifndef RADIO_TIMER_WHEEL_H
+#define RADIO_TIMER_WHEEL_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+/* Two level hierarchical timer wheel with millisecond ticks. The first level
+ * holds items due within NEAR_SLOTS ms, one slot per ms, the second one holds
+ * later items by FAR_SLOTS blocks of NEAR_SLOTS ms and cascades a block into
+ * the first level when its time comes. Items further than the whole second
+ * level cycle through it until they get close. */
+template <typename T>
+class timer_wheel {
+private:
+    static const unsigned NEAR_BITS = 8;
+    static const uint64_t NEAR_SLOTS = 1u << NEAR_BITS;
+    static const uint64_t FAR_SLOTS = 64;
+
+    typedef std::vector<std::pair<uint64_t, T>> slot; // (due, item)
+
+    std::vector<slot> near = std::vector<slot>(NEAR_SLOTS);
+    std::vector<slot> far = std::vector<slot>(FAR_SLOTS);
+    slot late; // added when already due
+    uint64_t tick = 0; // first ms not handled yet
+    size_t count = 0;
+
+    void place(uint64_t due, T &&item) {
+        if (due < tick)
+            late.emplace_back(due, std::move(item));
+        else if ((due >> NEAR_BITS) == (tick >> NEAR_BITS))
+            near[due & (NEAR_SLOTS - 1)].emplace_back(due, std::move(item));
+        else
+            far[(due >> NEAR_BITS) % FAR_SLOTS].emplace_back(due, std::move(item));
+    }
+
+    void cascade() {
+        slot moved;
+        moved.swap(far[(tick >> NEAR_BITS) % FAR_SLOTS]);
+        for (auto &entry : moved)
+            place(entry.first, std::move(entry.second));
+    }
+
+public:
+    void init(uint64_t now_ms) {
+        for (auto &s : near)
+            s.clear();
+        for (auto &s : far)
+            s.clear();
+        late.clear();
+        tick = now_ms;
+        count = 0;
+    }
+
+    bool empty() {
+        return count == 0;
+    }
+
+    void add(uint64_t due_ms, T item) {
+        place(due_ms, std::move(item));
+        ++count;
+    }
+
+    /* moves the items due at or before now_ms to out */
+    void advance(uint64_t now_ms, std::vector<T> &out) {
+        for (auto &entry : late)
+            out.push_back(std::move(entry.second));
+        count -= late.size();
+        late.clear();
+
+        for (; tick <= now_ms && count > 0; ++tick) {
+            if ((tick & (NEAR_SLOTS - 1)) == 0)
+                cascade();
+            slot &s = near[tick & (NEAR_SLOTS - 1)];
+            for (auto &entry : s)
+                out.push_back(std::move(entry.second));
+            count -= s.size();
+            s.clear();
+        }
+        if (count == 0 && tick <= now_ms)
+            tick = now_ms + 1;
+    }
+
+    /* ms from now_ms until the earliest item is due, -1 if there is none */
+    int64_t next_due(uint64_t now_ms) {
+        if (count == 0)
+            return -1;
+
+        if (!late.empty())
+            return 0;
+        uint64_t due = UINT64_MAX;
+        for (auto &s : near)
+            for (auto &entry : s)
+                due = std::min(due, entry.first);
+        for (auto &s : far)
+            for (auto &entry : s)
+                due = std::min(due, entry.first);
+        return due <= now_ms ? 0 : (int64_t)(due - now_ms);
+    }
+};
+
+
+#endif //RADIO_TIMER_WHEEL_H
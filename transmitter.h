@@ -3,9 +3,9 @@
 
 #include <unistd.h>
 #include <sys/socket.h>
-#include <iostream>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include "logger.h"
 
 class transmitter {
 private:
@@ -17,7 +17,7 @@ private:
         do {
             sock = socket(AF_INET, SOCK_DGRAM, 0);
             if (sock < 0) {
-                std::cerr << "Error: socket\n";
+                LOG_ERROR("Error: socket");
                 err = 1;
             }
 
@@ -25,7 +25,7 @@ private:
             optval = 1;
             if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (void *) &optval,
                            sizeof optval) < 0) {
-                std::cerr << "Error: setsockopt broadcast\n";
+                LOG_ERROR("Error: setsockopt broadcast");
                 err = 1;
             }
 
@@ -33,7 +33,7 @@ private:
             optval = TTL;
             if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (void *) &optval,
                            sizeof optval) < 0) {
-                std::cerr << "Error: setsockopt multicast ttl\n";
+                LOG_ERROR("Error: setsockopt multicast ttl");
                 err = 1;
             }
         } while (err);